@@ -14,9 +14,9 @@ static const char* const CLASS = "Blocky";
 static const char* const HELP =
   "This is a demonstration of a Nuke plugin that moves pixels by "
   "use of Tile. In this case blocks of pixels are averaged together "
-  "to produce the result. Notice that this implementation is much "
-  "slower than necessary as it does not reuse calculations done for "
-  "adjacent lines."
+  "to produce the result. The averages of a row of blocks are worked "
+  "out once, by whichever thread gets there first, and every line of "
+  "those blocks reuses them."
   "\n\n"
   "The source code has a lot of comments "
   "inserted into it to demonstrate how to write a plugin.";
@@ -30,6 +30,11 @@ static const char* const HELP =
 #include "DDImage/Row.h"
 #include "DDImage/Tile.h"
 #include "DDImage/Knobs.h"
+#include "DDImage/Thread.h"
+
+#include <map>
+#include <memory>
+#include <vector>
 
 using namespace DD::Image;
 
@@ -40,6 +45,28 @@ class Blocky : public Iop
 {
   // These are the locations the user interface will store into:
   double width, height;
+
+  // The averages of one row of blocks. All the lines in those blocks are
+  // the same, so the first engine thread to need them computes them and
+  // the others wait on the lock and then just copy them out:
+  struct BlockRow
+  {
+    Lock lock;
+    bool ready;
+    std::map<Channel, std::vector<float> > averages; // one per block from _area.x()
+    BlockRow() : ready(false) {}
+  };
+
+  // The block aligned area and the channels passed to request(), which is
+  // what the block rows are computed for:
+  Box _area;
+  ChannelSet _channels;
+  std::map<int, std::unique_ptr<BlockRow> > _blockRows;
+  Lock _blockRowsLock;
+
+  BlockRow* getBlockRow(int ty);
+  bool fillBlockRow(BlockRow& row, int ty);
+  void averageRows(int ty, int tx, int tr, ChannelMask channels, Row& out, int x, int r);
 public:
   // You must implement these functions:
   Blocky(Node*);
@@ -109,6 +136,10 @@ void Blocky::_validate(bool for_real)
             info_.y() / h * h,
             (info_.r() + w - 1) / w * w,
             (info_.t() + h - 1) / h * h);
+
+  // The size may have changed, so forget any averages:
+  Guard guard(_blockRowsLock);
+  _blockRows.clear();
 }
 
 // After open is done, "request" is called. This is passed a "viewport"
@@ -130,21 +161,66 @@ void Blocky::_request(int x, int y, int r, int t, ChannelMask channels, int coun
   y = y / h * h;
   t = (t + h - 1) / h * h;
   input0().request(x, y, r, t, channels, count);
+
+  // Remember what the block rows should cover, and throw away any that
+  // were computed for a different request:
+  Guard guard(_blockRowsLock);
+  _area.set(x, y, r, t);
+  _channels = channels;
+  _blockRows.clear();
 }
 
-// This is the operator that does all the work. For each line in the area
-// passed to request(), this will be called. It must calculate the image data
-// for a region at vertical position y, and between horizontal positions
-// x and r, and write it to the passed row structure. Usually this works
-// by asking the input for data, and modifying it:
-void Blocky::engine(int y, int x, int r, ChannelMask channels, Row& out)
+// Return the block row starting at line ty, computing it if no other
+// thread has done so yet. Returns null if it was aborted:
+Blocky::BlockRow* Blocky::getBlockRow(int ty)
+{
+  BlockRow* row;
+  {
+    // This lock only protects the map, so it is held very briefly:
+    Guard guard(_blockRowsLock);
+    std::unique_ptr<BlockRow>& slot = _blockRows[ty];
+    if (!slot)
+      slot.reset(new BlockRow);
+    row = slot.get();
+  }
+
+  // This lock is held while the averages are computed, so other threads
+  // wanting the same block row wait for them rather than repeating the work:
+  Guard guard(row->lock);
+  if (!row->ready && !fillBlockRow(*row, ty))
+    return nullptr;
+  return row;
+}
+
+bool Blocky::fillBlockRow(BlockRow& row, int ty)
+{
+  int w = int(width);
+  int tx = _area.x();
+  int tr = _area.r();
+  Row averages(tx, tr);
+  averageRows(ty, tx, tr, _channels, averages, tx, tr);
+  // You must always check for aborted after getting input. If the
+  // operation was aborted, the row contains bad data and must not be kept:
+  if (Op::aborted())
+    return false;
+
+  // Keep one value for each block:
+  foreach (z, _channels) {
+    std::vector<float>& blocks = row.averages[z];
+    blocks.resize((tr - tx) / w);
+    for (size_t i = 0; i < blocks.size(); i++)
+      blocks[i] = averages[z][tx + int(i) * w];
+  }
+  row.ready = true;
+  return true;
+}
+
+// Average the blocks starting at line ty and spanning tx to tr, writing the
+// result between x and r of out:
+void Blocky::averageRows(int ty, int tx, int tr, ChannelMask channels, Row& out, int x, int r)
 {
-  // Figure out a rectangle we want from the input:
   int w = int(width);
   int h = int(height);
-  int tx = x / w * w;
-  int tr = (r + w - 1) / w * w;
-  int ty = y / h * h;
   int tt = ty + h;
 
   // Lock an area into the cache:
@@ -193,3 +269,41 @@ void Blocky::engine(int y, int x, int r, ChannelMask channels, Row& out)
     }
   }
 }
+
+// This is the operator that does all the work. For each line in the area
+// passed to request(), this will be called. It must calculate the image data
+// for a region at vertical position y, and between horizontal positions
+// x and r, and write it to the passed row structure. Usually this works
+// by asking the input for data, and modifying it:
+void Blocky::engine(int y, int x, int r, ChannelMask channels, Row& out)
+{
+  // Figure out a rectangle we want from the input:
+  int w = int(width);
+  int h = int(height);
+  int tx = x / w * w;
+  int tr = (r + w - 1) / w * w;
+  int ty = y / h * h;
+
+  // If this line is outside what was requested, which should not happen,
+  // just compute it directly:
+  bool inside = tx >= _area.x() && tr <= _area.r() && ty >= _area.y() && ty < _area.t();
+  foreach (z, channels)
+    if (!_channels.contains(z))
+      inside = false;
+  if (!inside) {
+    averageRows(ty, tx, tr, channels, out, x, r);
+    return;
+  }
+
+  BlockRow* row = getBlockRow(ty);
+  if (!row)
+    return;
+
+  // Every line of the blocks is the same, so copy the averages out:
+  foreach (z, channels) {
+    const float* blocks = &row->averages[z][0];
+    float* TO = out.writable(z);
+    for (int X = x; X < r; X++)
+      TO[X] = blocks[(X - _area.x()) / w];
+  }
+}
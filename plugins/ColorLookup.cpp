@@ -14,6 +14,7 @@ const char* const HELP =
 #include <stdexcept>
 #include <memory>
 #include <algorithm>
+#include <vector>
 
 using namespace DD::Image;
 
@@ -28,6 +29,24 @@ static const CurveDescription defaults[] = {
   { nullptr }
 };
 
+/*! Look v up in a baked curve with linear interpolation, continuing the curve with its end gradients
+    outside the table. Written without branches on v so the compiler can vectorize the arithmetic.
+*/
+template<class Curve>
+static inline float evaluate(const Curve& curve, float v)
+{
+  const int last = int(curve.table.size()) - 1;
+  float t = (v - curve.lo) * curve.scale;
+  t = t > 0.0f ? t : 0.0f;   // also catches NaN
+  t = t < float(last) ? t : float(last);
+  const int i = std::min(int(t), last - 1);
+  const float f = t - float(i);
+  const float* entry = &curve.table[i];
+  const float below = std::min(v - curve.lo, 0.0f) * curve.leftGradient;
+  const float above = std::max(v - curve.hi, 0.0f) * curve.rightGradient;
+  return entry[0] + f * (entry[1] - entry[0]) + below + above;
+}
+
 class ColorLookupIop : public ColorLookup
 {
   LookupCurves lut;
@@ -73,8 +92,28 @@ class ColorLookupIop : public ColorLookup
   */
   void bakeCurves();
 
+  /*! One curve baked for the CPU path: table entries evenly spaced from lo to hi, and the gradients
+      the curve is continued with past either end, where it is a straight line.
+  */
+  struct CpuCurve
+  {
+    std::vector<float> table;
+    float lo, hi;
+    float scale;                // (entries - 1) / (hi - lo)
+    float leftGradient, rightGradient;
+  };
+
+  /*! The master curve and then the curve of each channel, for use in pixel_engine when the precomputed
+      table is on. Unlike the ColorLookup table, values outside 0..range still don't evaluate the curves.
+  */
+  CpuCurve _cpuCurves[NUMTABLES + 1];
+  bool _useCpuCurves;
+  int _tableSize;
+
+  void bakeCpuCurves();
+
 public:
-  ColorLookupIop(Node* node) : ColorLookup(node), lut(defaults), _usePrecomputedTable(true)
+  ColorLookupIop(Node* node) : ColorLookup(node), lut(defaults), _usePrecomputedTable(true), _useCpuCurves(false), _tableSize(4096)
   {
     //identity[0..4] = true;
     range = range_knob = 1;
@@ -111,7 +150,18 @@ void ColorLookupIop::pixel_engine(const Row& in, int y, int x, int r, ChannelMas
   }
 
   try {
-    if (_usePrecomputedTable) {
+    if (_usePrecomputedTable && _useCpuCurves) {
+      // interpolate the master table, then the channel's table
+      const CpuCurve& master = _cpuCurves[0];
+      foreach (z, channels) {
+        const CpuCurve& curve = _cpuCurves[colourIndex(z) + 1];
+        const float* FROM = in[z] + x;
+        float* TO = out.writable(z) + x;
+        for (int i = 0; i < r - x; i++)
+          TO[i] = evaluate(curve, evaluate(master, FROM[i]));
+      }
+    }
+    else if (_usePrecomputedTable) {
       if (range == 1.0f) {
         ColorLookup::pixel_engine(in, y, x, r, channels, out);
       }
@@ -173,9 +223,12 @@ void ColorLookupIop::_validate(bool for_real)
   else
     range = range_knob;
   //for (int i = 0; i < 5; i++) identity[i] = lut.isIdentity(i, range);
+  if (_tableSize < 2)
+    _tableSize = 2;
   try {
     ColorLookup::_validate(for_real);
     bakeCurves();
+    bakeCpuCurves();
   }
   catch (std::out_of_range& ex) {
     error(ex.what());
@@ -244,6 +297,12 @@ void ColorLookupIop::knobs(Knob_Callback f)
 
   Float_knob(f, &range_knob, IRange(1, 16), "range");
   Tooltip(f, "Values between 0 and this will use a lookup table and thus be much faster");
+
+  Int_knob(f, &_tableSize, IRange(256, 65536), "table_size", "table size");
+  SetFlags(f, Knob::NODEGRAPH_ONLY);
+  Tooltip(f, "Number of entries in the precomputed table of each curve. Values beyond the table, "
+             "such as HDR values above 'range', continue the curve along its end gradient "
+             "instead of evaluating it. Curves with expressions use the old table of 0 to 'range'.");
   
   LookupCurves_knob(f, &lut, "lut");
   Newline(f);
@@ -289,6 +348,7 @@ int ColorLookupIop::knob_changed(Knob* k)
 
   if (k->name() == "use_precomputed" || k == &Knob::showPanel) {
     knob("range")->enable(_usePrecomputedTable);
+    knob("table_size")->enable(_usePrecomputedTable);
   }
 
   return 1;
@@ -331,6 +391,40 @@ void ColorLookupIop::bakeCurves()
   }
 }
 
+void ColorLookupIop::bakeCpuCurves()
+{
+  // Expressions cannot be evaluated outside 0 to 1, they keep using the base class's table
+  _useCpuCurves = _usePrecomputedTable && nodeContext() != eTimeline;
+  for (size_t c = 0; c < lut.size(); ++c) {
+    if (lut.hasExpression(c))
+      _useCpuCurves = false;
+  }
+  if (!_useCpuCurves)
+    return;
+
+  for (int c = 0; c <= NUMTABLES; ++c) {
+    CpuCurve& curve = _cpuCurves[c];
+    LookupCurves::SKey leftmostKey;
+    LookupCurves::SKey rightmostKey;
+    lut.getOuterKeys(c, leftmostKey, rightmostKey);
+
+    // past its outer keys the curve is a straight line, so the table covers those and 0 to range
+    curve.lo = std::min(leftmostKey.x, 0.0f);
+    curve.hi = std::max(rightmostKey.x, range);
+    if (curve.hi <= curve.lo)
+      curve.hi = curve.lo + 1.0f;
+    curve.leftGradient = leftmostKey.slope;
+    curve.rightGradient = rightmostKey.slope;
+    curve.scale = (_tableSize - 1) / (curve.hi - curve.lo);
+
+    curve.table.resize(_tableSize);
+    for (int i = 0; i < _tableSize; ++i) {
+      const double x = curve.lo + (curve.hi - curve.lo) * (i / double(_tableSize - 1));
+      curve.table[i] = float(lut.getValue(c, x));
+    }
+  }
+}
+
 const char* ColorLookupIop::gpuEngine_decl() const
 {
   if (nodeContext() != eTimeline) {
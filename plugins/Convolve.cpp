@@ -7,9 +7,23 @@ static const char HELP[] =
   "perform the convolution on, Input A is the convolution matrix. "
   "@i;It is very much recommended that you Crop input A to a small "
   "area! @n;The cropped area is what is used, the center of the "
-  "filter is the center of the crop.";
+  "filter is the center of the crop. @n;"
+  "Large matrices are convolved with FFTs over blocks of the image, "
+  "which costs about the same whatever the size of the matrix. "
+  "Matrices that are the product of a column and a row, such as "
+  "gaussians and boxes, are detected and run as a vertical and then a "
+  "horizontal pass.";
 
 #include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <complex>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 #include "DDImage/Iop.h"
 #include "DDImage/DDString.h"
 #include "DDImage/Thread.h"
@@ -21,28 +35,164 @@ static const char HELP[] =
 #include "DDImage/MultiTileIop.h"
 #include "DDImage/MultiTileIopEngineDefinitions.h"
 
-#ifndef FN_PROCESSOR_PPC
-  #include <xmmintrin.h>
-#endif
+#include "ConvolveTaps.h"
 
 using namespace DD::Image;
 
+static const char* const methodNames[] = { "auto", "direct", "fft", nullptr };
+
+enum { METHOD_AUTO, METHOD_DIRECT, METHOD_FFT };
+
+// In auto mode, matrices with at least this many entries use the FFT:
+static const int kFFTMinTaps = 25 * 25;
+
+typedef std::complex<float> Complex;
+
+// Most memory the row rings of one Convolve hold between them. A thread
+// whose ring would not fit fetches every row instead:
+static const size_t kRowRingMaxBytes = size_t(64) << 20;
+
+/*! The input rows one engine thread read last. Rows live in slot
+   y % size, so the next output row the thread does, usually a few rows
+   further on, only fetches the rows it does not share with the last one.
+   Only the thread that owns a ring touches it.
+ */
+struct RowRing
+{
+  int x, r;                      // span every row covers
+  int size;                      // rows held, the height of the matrix
+  ChannelSet channels;
+  int channelIndex[Chan_Last + 1];
+  int channelCount;
+  std::vector<int> rowY;         // input row in each slot
+  std::vector<float> storage;    // slot, channel, pixel
+  std::vector<char> zero;        // slot, channel
+
+  RowRing() : x(0), r(0), size(0), channelCount(0) {}
+
+  bool matches(int x_, int r_, int size_, ChannelMask channels_) const
+  {
+    return x == x_ && r == r_ && size == size_ && channels == channels_;
+  }
+  void reset(int x_, int r_, int size_, ChannelMask channels_);
+
+  // Make sure row y is held, reading it from input if it is not.
+  void fetch(Iop& input, int y, Row& scratch);
+
+  // Row y of channel z indexed by x, null where it is all zero.
+  const float* channelRow(int y, Channel z) const
+  {
+    const size_t i = size_t(slot(y)) * channelCount + channelIndex[z];
+    return zero[i] ? nullptr : &storage[i * (r - x)] - x;
+  }
+
+  int slot(int y) const { return ((y % size) + size) % size; }
+};
+
+// Bit reversal and twiddle factors for radix-2 FFTs of one power of two size.
+struct FFTPlan
+{
+  int n;
+  std::vector<int> bitReverse;
+  std::vector<Complex> twiddles;   // exp(-2 pi i k / n) for k < n / 2
+
+  explicit FFTPlan(int size = 1);
+  void transform(Complex* data, int stride, bool inverse) const;
+};
+
 class Convolve : public MultiTileIop
 {
 
   bool K_normalize;
+  int _method;
+  float _separableTolerance;
+  std::string _pathInfo;
+  std::string _pathUpdate;      // path text worked out by prepareMatrix(), shown by updateUI
+  Lock _pathLock;
   int filterWidth;
   int filterHeight;
   Channel channel;
-  ChannelSet _sumChannels;
-  float _sum[Chan_Last + 1];
-  template<class TileType> void generateSum(const TileType& tile, ChannelMask channels);
-  Lock _sumLock;
+
+  // One channel of the A matrix, read by the first engine call after each
+  // _validate. Engine threads only read these once _matrixReady is set.
+  struct Kernel
+  {
+    typedef FilterTap Tap;          // offset is from the leftmost input pixel the row reaches
+
+    std::vector<float> storage;
+    size_t alignOffset;
+    std::vector<Tap> taps;          // non-zero entries in the order the engine uses them
+    std::vector<int> rowStart;      // taps of input row Y are [rowStart[Y], rowStart[Y + 1])
+    float sum;
+    std::vector<float> column;      // separable factors, bottom row and left column first
+    std::vector<float> row;
+    std::vector<Complex> spectrum;  // transform used by the fft method
+
+    // filterWidth x filterHeight entries, bottom row first, on a cache line
+    const float* values() const { return &storage[alignOffset]; }
+  };
+
+  std::map<Channel, Kernel> _kernels;
+
+  // The matrix used for output channel z, null if A does not have it.
+  const Kernel* kernel(Channel z) const
+  {
+    std::map<Channel, Kernel>::const_iterator it = _kernels.find(channel ? channel : z);
+    return it == _kernels.end() ? nullptr : &it->second;
+  }
+
+  bool _useSeparable;
+
+  // set once the matrix, the method and the spectra are worked out
+  std::atomic<bool> _matrixReady;
+  Lock _matrixLock;
+
+  bool bakeMatrix();
+  bool factorMatrix();
+  bool prepareMatrix();
+
+  // FFT convolution: the output is cut into blocks of _blockW x _blockH,
+  // each computed with one _fftW x _fftH transform of the block plus the
+  // filter apron, and kept so every row of the block can use it.
+  struct FFTBlock
+  {
+    Lock lock;
+    std::map<Channel, std::vector<float> > planes;
+  };
+
+  bool _useFFT;
+
+  // multi-tap inner loop of the direct method, chosen for this processor
+  ConvolveTapsFn _convolveTaps;
+  const char* _convolveTapsName;
+  int _fftW, _fftH;
+  int _blockW, _blockH;
+  FFTPlan _planX, _planY;
+  Box _outArea;                                   // requested output area
+  std::map<std::pair<int, int>, std::unique_ptr<FFTBlock> > _fftBlocks;
+  Lock _fftBlocksLock;
+
+  void fft2D(std::vector<Complex>& data, bool inverse) const;
+  const float* fftBlockRow(const Kernel& k, int bx, int by, int y, Channel z);
+  void fftEngine(int y, int x, int r, ChannelMask channels, Row& row, float** outptrs);
+  // one ring per engine thread, dropped whenever the request changes and
+  // when the op is closed
+  std::map<my_thread_id_type, std::unique_ptr<RowRing> > _rowRings;
+  size_t _rowRingBytes;                           // storage of all the rings
+  Lock _rowRingsLock;
+
+  RowRing* rowRing(int x, int r, ChannelMask channels);
+  void clearRowRings();
+
+  void directEngine(int y, int x, int r, ChannelMask channels, Row& row, float** outptrs);
+  void separableEngine(int y, int x, int r, ChannelMask channels, Row& row, float** outptrs);
 public:
 
   Convolve(Node*);
   void _validate(bool) override;
   void _request(int, int, int, int, ChannelMask, int) override;
+  void _close() override;
+  bool updateUI(const OutputContext&) override;
   void knobs(Knob_Callback) override;
   const char* Class() const override { return CLASS; }
   const char* node_help() const override { return HELP; }
@@ -61,11 +211,22 @@ const Iop::Description Convolve::d(CLASS, "Filter/Convolve", Convolve_c);
 Convolve::Convolve(Node* node)
   : MultiTileIop(node),
   K_normalize( true ),
+  _method( METHOD_AUTO ),
+  _separableTolerance( 0.001f ),
   filterWidth( 0 ),
   filterHeight( 0 ),
-  channel(Chan_Black)
+  channel(Chan_Black),
+  _useSeparable( false ),
+  _matrixReady( false ),
+  _useFFT( false ),
+  _fftW( 1 ),
+  _fftH( 1 ),
+  _blockW( 1 ),
+  _blockH( 1 ),
+  _rowRingBytes( 0 )
 {
   inputs(2);
+  _convolveTaps = SelectConvolveTaps(&_convolveTapsName);
 }
 
 void Convolve::knobs(Knob_Callback f)
@@ -77,6 +238,184 @@ void Convolve::knobs(Knob_Callback f)
   Bool_knob(f, &K_normalize, "normalize", "Normalize");
   Tooltip(f, "Divide the result by the sum of all the numbers in the "
              "convolution matrix from A.");
+  Enumeration_knob(f, &_method, methodNames, "method", "method");
+  Tooltip(f, "How to convolve.\n"
+             "direct: multiply-add every entry of the matrix for every pixel, "
+             "the cost grows with the size of the matrix.\n"
+             "fft: convolve blocks of the image with FFTs, the cost hardly "
+             "depends on the size of the matrix.\n"
+             "auto: separable passes if the matrix allows it, otherwise fft "
+             "for matrices of 25x25 or more and direct for smaller ones.");
+  Float_knob(f, &_separableTolerance, IRange(0, 0.1), "separable_tolerance", "separable tolerance");
+  Tooltip(f, "In auto mode, run the matrix as a vertical and a horizontal pass when "
+             "the best column times row product leaves at most this fraction of "
+             "the matrix's energy unexplained. 0 only accepts matrices that are "
+             "separable up to rounding.");
+  String_knob(f, &_pathInfo, "path", "path");
+  SetFlags(f, Knob::NO_ANIMATION | Knob::NO_RERENDER | Knob::DO_NOT_WRITE | Knob::READ_ONLY);
+  Tooltip(f, "The method used for the last render, and why.");
+}
+
+/*! Read every channel of A that can be used into _kernels: the entries,
+   the list of non-zero ones and their sum. Returns false, with _kernels
+   empty, if A could not be read.
+ */
+bool Convolve::bakeMatrix()
+{
+  _kernels.clear();
+
+  ChannelSet kernelChannels = channel ? ChannelSet(channel) : input1().info().channels();
+  Tile tile(input1(), kernelChannels);
+  if (aborted() || !tile.valid())
+    return false;
+
+  // the matrix is the bounding box of A, whichever corner it starts at
+  const int w = filterWidth;
+  const int h = filterHeight;
+
+  foreach (z, kernelChannels) {
+    if (!(tile.channels() & z))
+      continue;
+
+    Kernel& k = _kernels[z];
+    k.storage.assign(size_t(w) * h + 16, 0.0f);
+    const size_t misalign = (reinterpret_cast<uintptr_t>(k.storage.data()) / sizeof(float)) % 16;
+    k.alignOffset = misalign ? 16 - misalign : 0;
+
+    float* values = &k.storage[k.alignOffset];
+    k.sum = 0;
+    for (int v = 0; v < std::min(h, tile.h()); ++v) {
+      Tile::RowPtr filterptr = tile[z][tile.y() + v];
+      for (int u = 0; u < std::min(w, tile.w()); ++u) {
+        values[size_t(v) * w + u] = filterptr[tile.x() + u];
+        k.sum += filterptr[tile.x() + u];
+      }
+    }
+
+    // input row Y meets matrix row h - 1 - Y, and the input pixel at
+    // offset j meets matrix column w - 1 - j
+    k.rowStart.resize(h + 1);
+    for (int Y = 0; Y < h; ++Y) {
+      k.rowStart[Y] = int(k.taps.size());
+      const float* matrixRow = values + size_t(h - 1 - Y) * w;
+      for (int j = 0; j < w; ++j) {
+        if (matrixRow[w - 1 - j]) {
+          Kernel::Tap tap = { j, matrixRow[w - 1 - j] };
+          k.taps.push_back(tap);
+        }
+      }
+    }
+    k.rowStart[h] = int(k.taps.size());
+  }
+  return true;
+}
+
+/*! Try to write every channel of the matrix as column * row. The best such
+   product is given by the largest singular value, found by power iteration
+   on the matrix times its transpose. Returns true if every channel is
+   within the tolerance.
+ */
+bool Convolve::factorMatrix()
+{
+  const int w = filterWidth;
+  const int h = filterHeight;
+  bool separable = w > 1 && h > 1 && !_kernels.empty();
+
+  for (std::map<Channel, Kernel>::iterator it = _kernels.begin(); separable && it != _kernels.end(); ++it) {
+    Kernel& factors = it->second;
+    const float* values = factors.values();
+
+    std::vector<double> m(size_t(w) * h);
+    double energy = 0;
+    for (size_t i = 0; i < m.size(); ++i) {
+      m[i] = values[i];
+      energy += m[i] * m[i];
+    }
+
+    factors.column.assign(h, 0.0f);
+    factors.row.assign(w, 0.0f);
+    if (energy == 0)
+      continue;
+
+    // power iteration, starting from the row of largest energy
+    std::vector<double> b(w), c(h);
+    int start = 0;
+    double best = -1;
+    for (int v = 0; v < h; ++v) {
+      double e = 0;
+      for (int u = 0; u < w; ++u)
+        e += m[size_t(v) * w + u] * m[size_t(v) * w + u];
+      if (e > best) {
+        best = e;
+        start = v;
+      }
+    }
+    for (int u = 0; u < w; ++u)
+      b[u] = m[size_t(start) * w + u];
+
+    double sigma2 = 0;
+    for (int iteration = 0; iteration < 100; ++iteration) {
+      double norm = 0;
+      for (int u = 0; u < w; ++u)
+        norm += b[u] * b[u];
+      norm = sqrt(norm);
+      if (norm == 0)
+        break;
+      for (int u = 0; u < w; ++u)
+        b[u] /= norm;
+
+      double cc = 0;
+      for (int v = 0; v < h; ++v) {
+        c[v] = 0;
+        for (int u = 0; u < w; ++u)
+          c[v] += m[size_t(v) * w + u] * b[u];
+        cc += c[v] * c[v];
+      }
+      for (int u = 0; u < w; ++u) {
+        b[u] = 0;
+        for (int v = 0; v < h; ++v)
+          b[u] += m[size_t(v) * w + u] * c[v];
+      }
+
+      const double previous = sigma2;
+      sigma2 = cc;
+      if (sigma2 - previous <= 1e-12 * energy)
+        break;
+    }
+
+    // c = M b for the last unit b, so M ~= c b^T
+    double norm = 0;
+    for (int u = 0; u < w; ++u)
+      norm += b[u] * b[u];
+    norm = sqrt(norm);
+    if (norm == 0)
+      continue;
+    double cb = 0;
+    for (int v = 0; v < h; ++v) {
+      c[v] = 0;
+      for (int u = 0; u < w; ++u)
+        c[v] += m[size_t(v) * w + u] * b[u] / norm;
+      cb += c[v] * c[v];
+    }
+    for (int v = 0; v < h; ++v)
+      factors.column[v] = float(c[v]);
+    for (int u = 0; u < w; ++u)
+      factors.row[u] = float(b[u] / norm);
+
+    // allow for rounding so that exactly separable matrices pass at 0
+    if (energy - cb > (double(_separableTolerance) + 1e-6) * energy)
+      separable = false;
+  }
+
+  return separable;
+}
+
+static int nextPowerOfTwo(int v)
+{
+  int n = 1;
+  while (n < v)
+    n <<= 1;
+  return n;
 }
 
 void Convolve::_validate(bool for_real)
@@ -87,44 +426,93 @@ void Convolve::_validate(bool for_real)
   filterWidth = input1().w();
   filterHeight = input1().h();
   info_.clipmove(-filterWidth / 2, -filterHeight / 2, (filterWidth - 1) / 2, (filterHeight - 1) / 2);
-  _sumChannels.clear();
+
+  // A's pixels are only read once it has been requested, see prepareMatrix()
+  {
+    Guard guard(_matrixLock);
+    _matrixReady = false;
+    _kernels.clear();
+  }
+  {
+    Guard guard(_fftBlocksLock);
+    _fftBlocks.clear();
+  }
+  clearRowRings();
 }
 
-template<class TileType> void Convolve::generateSum(const TileType& tile, ChannelMask channels)
+/*! Everything the engines need from A, worked out by the first engine call
+   after _validate: the matrix, which method runs it, and the spectra for
+   the fft method. Returns false if A could not be read, which leaves it to
+   the next call to try again.
+ */
+bool Convolve::prepareMatrix()
 {
-  Guard guard(_sumLock);
-
-  DD::Image::ChannelSet newChannels = channels;
-  newChannels -= _sumChannels;
-
-  if (newChannels.empty()) {
-    return;
+  if (_matrixReady)
+    return true;
+  Guard guard(_matrixLock);
+  if (_matrixReady)
+    return true;
+
+  if (!bakeMatrix())
+    return false;
+
+  _useSeparable = _method == METHOD_AUTO && factorMatrix();
+
+  _useFFT = !_useSeparable &&
+            (_method == METHOD_FFT ||
+             (_method == METHOD_AUTO && filterWidth * filterHeight >= kFFTMinTaps));
+  if (_useFFT) {
+    // transforms of at least twice the filter size keep the apron, which
+    // is thrown away, to less than half of each block
+    _fftW = nextPowerOfTwo(std::max(64, 2 * filterWidth));
+    _fftH = nextPowerOfTwo(std::max(64, 2 * filterHeight));
+    _blockW = _fftW - filterWidth + 1;
+    _blockH = _fftH - filterHeight + 1;
+    if (_planX.n != _fftW)
+      _planX = FFTPlan(_fftW);
+    if (_planY.n != _fftH)
+      _planY = FFTPlan(_fftH);
+
+    // the matrix in the corner of a transform sized array
+    for (std::map<Channel, Kernel>::iterator it = _kernels.begin(); it != _kernels.end(); ++it) {
+      Kernel& k = it->second;
+      k.spectrum.assign(size_t(_fftW) * _fftH, Complex(0, 0));
+      for (int v = 0; v < filterHeight; ++v)
+        for (int u = 0; u < filterWidth; ++u)
+          k.spectrum[size_t(v) * _fftW + u] = Complex(k.values()[size_t(v) * filterWidth + u], 0);
+      fft2D(k.spectrum, false);
+    }
   }
 
-  memset(_sum, 0, sizeof(float) * (Chan_Last + 1));
-  const int xStart = tile.x();
-  const int xEnd = tile.r();
-  ChannelSet toProcess = channel ? channel : channels;
-  foreach (z, toProcess) {
-    if (!(tile.channels() & z)) {
-      _sum[z] = 1.0f;
-      continue;
-    }
-    for (int y = tile.y(); y < tile.t(); ++y) {
-      typename TileType::RowPtr filterptr = tile[z][y];
-      for (int i = xStart; i < xEnd; ++i) {
-        _sum[z] += filterptr[i];
-      }
-    }
+  char path[128];
+  if (_useSeparable)
+    snprintf(path, sizeof(path), "separable: %d + %d taps per pixel", filterHeight, filterWidth);
+  else if (_useFFT)
+    snprintf(path, sizeof(path), "fft: %dx%d transforms", _fftW, _fftH);
+  else
+    snprintf(path, sizeof(path), "direct (%s): %d taps per pixel", _convolveTapsName, filterWidth * filterHeight);
+  {
+    Guard pathGuard(_pathLock);
+    _pathUpdate = path;
   }
-  if (channel) {
-    foreach (z, channels) {
-      if (z == channel)
-        continue;
-      _sum[z] = _sum[channel];
-    }
+
+  _matrixReady = true;
+  return true;
+}
+
+// The path is worked out on render threads, so the knob is only set here,
+// from the main thread.
+bool Convolve::updateUI(const OutputContext&)
+{
+  std::string path;
+  {
+    Guard guard(_pathLock);
+    path = _pathUpdate;
   }
-  _sumChannels = channels;
+  Knob* pathKnob = knob("path");
+  if (pathKnob != nullptr && !path.empty() && _pathInfo != path)
+    pathKnob->set_text(path.c_str());
+  return true;
 }
 
 void Convolve::_request(int x, int y, int r, int t, ChannelMask channels, int count)
@@ -140,50 +528,205 @@ void Convolve::_request(int x, int y, int r, int t, ChannelMask channels, int co
 
   input(0)->request(x, y, r, t, channels, count);
 
-  _sumChannels.clear();
+  // FFT blocks are clipped to the requested area so they only read input
+  // that was requested
+  Guard guard(_fftBlocksLock);
+  _outArea.set(x + (filterWidth - 1) / 2, y + (filterHeight - 1) / 2,
+               r - (filterWidth) / 2, t - (filterHeight) / 2);
+  _fftBlocks.clear();
+  clearRowRings();
+}
+
+void RowRing::reset(int x_, int r_, int size_, ChannelMask channels_)
+{
+  x = x_;
+  r = r_;
+  size = size_;
+  channels = channels_;
+  channelCount = 0;
+  foreach (z, channels)
+    channelIndex[z] = channelCount++;
+  rowY.assign(size, INT_MIN);
+  storage.assign(size_t(size) * channelCount * (r - x), 0.0f);
+  storage.shrink_to_fit();       // Convolve counts the ring by its size
+  zero.assign(size_t(size) * channelCount, 1);
+}
+
+void RowRing::fetch(Iop& input, int y, Row& scratch)
+{
+  const int s = slot(y);
+  if (rowY[s] == y)
+    return;
+
+  rowY[s] = INT_MIN;
+  input.get(y, x, r, channels, scratch);
+  if (input.aborted())
+    return;
+
+  foreach (z, channels) {
+    const size_t i = size_t(s) * channelCount + channelIndex[z];
+    zero[i] = scratch.is_zero(z);
+    if (!zero[i])
+      memcpy(&storage[i * (r - x)], scratch[z] + x, (r - x) * sizeof(float));
+  }
+  rowY[s] = y;
+}
+
+FFTPlan::FFTPlan(int size)
+  : n(size), bitReverse(size), twiddles(size / 2)
+{
+  int bits = 0;
+  while ((1 << bits) < n)
+    bits++;
+  for (int i = 0; i < n; ++i) {
+    int reversed = 0;
+    for (int b = 0; b < bits; ++b)
+      if (i & (1 << b))
+        reversed |= 1 << (bits - 1 - b);
+    bitReverse[i] = reversed;
+  }
+  for (int k = 0; k < n / 2; ++k) {
+    const double angle = -2 * M_PI * k / n;
+    twiddles[k] = Complex(float(cos(angle)), float(sin(angle)));
+  }
 }
 
-static size_t GetFloatAlignOffset(const float* buffer)
+// In-place iterative radix-2 FFT of n values spaced stride apart. The
+// inverse is not scaled.
+void FFTPlan::transform(Complex* data, int stride, bool inverse) const
 {
-  size_t alignedStart = (size_t)buffer;
-  size_t offset = alignedStart & 15;
-  if ( 0 == offset ) {
-    return 0;
+  for (int i = 0; i < n; ++i) {
+    const int j = bitReverse[i];
+    if (i < j)
+      std::swap(data[i * stride], data[j * stride]);
+  }
+  for (int len = 2; len <= n; len <<= 1) {
+    const int half = len / 2;
+    const int step = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int k = 0; k < half; ++k) {
+        Complex w = twiddles[k * step];
+        if (inverse)
+          w = std::conj(w);
+        Complex& a = data[(i + k) * stride];
+        Complex& b = data[(i + k + half) * stride];
+        const Complex t = w * b;
+        b = a - t;
+        a += t;
+      }
+    }
   }
-  
-  size_t startBit = 16 - offset;
-  size_t startFloat = startBit / 4;
-  return startFloat;
 }
 
-static void FnConvolve(float* outptr, const float* inptr, float filterValue, int start, int end)
+// 2D transform of a _fftW x _fftH row-major array. The inverse is scaled.
+void Convolve::fft2D(std::vector<Complex>& data, bool inverse) const
 {
-#if 0
-  for (int xx = start; xx < end; ++xx) {
-    outptr[xx] += inptr[xx] * filterValue;
+  for (int j = 0; j < _fftH; ++j)
+    _planX.transform(&data[size_t(j) * _fftW], 1, inverse);
+
+  // columns are copied out so the transform walks contiguous memory
+  std::vector<Complex> column(_fftH);
+  for (int i = 0; i < _fftW; ++i) {
+    for (int j = 0; j < _fftH; ++j)
+      column[j] = data[size_t(j) * _fftW + i];
+    _planY.transform(&column[0], 1, inverse);
+    for (int j = 0; j < _fftH; ++j)
+      data[size_t(j) * _fftW + i] = column[j];
   }
-  return;
-#endif
 
-  int i = start;
-#ifndef FN_PROCESSOR_PPC
-  size_t startFloat = GetFloatAlignOffset(&outptr[start]) + start;
+  if (inverse) {
+    const float scale = 1.0f / (float(_fftW) * _fftH);
+    for (size_t i = 0; i < data.size(); ++i)
+      data[i] *= scale;
+  }
+}
 
-  for (; i < int(startFloat); ++i) {
-    outptr[i] += inptr[i] * filterValue;
+/*! Row y of the FFT block (bx, by) for channel z, computing that channel of
+   the block if no other thread has yet. Returns null if aborted.
+ */
+const float* Convolve::fftBlockRow(const Kernel& k, int bx, int by, int y, Channel z)
+{
+  FFTBlock* block;
+  {
+    Guard guard(_fftBlocksLock);
+    std::unique_ptr<FFTBlock>& slot = _fftBlocks[std::make_pair(bx, by)];
+    if (!slot)
+      slot.reset(new FFTBlock);
+    block = slot.get();
   }
 
-  int lastValToCpy = ((end - startFloat) / 4) * 4 + startFloat;
-  __m128 f = _mm_load_ps1(&filterValue);
-  for (; i < lastValToCpy; i += 4) {
-    __m128 input = _mm_loadu_ps(&inptr[i]);
-    __m128 output = _mm_load_ps(&outptr[i]);
-    output = _mm_add_ps(output, _mm_mul_ps(input, f));
-    _mm_store_ps(&outptr[i], output);
+  const int X0 = _outArea.x() + bx * _blockW;
+  const int Y0 = _outArea.y() + by * _blockH;
+  const int blockR = std::min(X0 + _blockW, _outArea.r());
+  const int blockT = std::min(Y0 + _blockH, _outArea.t());
+
+  Guard guard(block->lock);
+  std::map<Channel, std::vector<float> >::iterator it = block->planes.find(z);
+  if (it == block->planes.end()) {
+    // The block's pixels plus the apron the filter reaches, in the corner
+    // of the transform. Output (X0 + i, Y0 + j) is then the circular
+    // convolution at (i + filterWidth - 1, j + filterHeight - 1), which the
+    // wrap-around cannot reach.
+    const int inX = X0 - (filterWidth - 1) / 2;
+    const int inY = Y0 - (filterHeight - 1) / 2;
+    const int inR = blockR + filterWidth / 2;
+    const int inT = blockT + filterHeight / 2;
+
+    std::vector<Complex> data(size_t(_fftW) * _fftH, Complex(0, 0));
+    Row inrow(inX, inR);
+    for (int Y = inY; Y < inT; ++Y) {
+      input0().get(Y, inX, inR, z, inrow);
+      if (aborted())
+        return nullptr;
+      const float* inptr = inrow[z];
+      Complex* dst = &data[size_t(Y - inY) * _fftW];
+      for (int X = inX; X < inR; ++X)
+        dst[X - inX] = Complex(inptr[X], 0);
+    }
+
+    fft2D(data, false);
+    for (size_t i = 0; i < data.size(); ++i)
+      data[i] *= k.spectrum[i];
+    fft2D(data, true);
+
+    std::vector<float>& plane = block->planes[z];
+    plane.resize(size_t(_blockW) * _blockH);
+    for (int j = 0; j < blockT - Y0; ++j)
+      for (int i = 0; i < blockR - X0; ++i)
+        plane[size_t(j) * _blockW + i] = data[size_t(j + filterHeight - 1) * _fftW + i + filterWidth - 1].real();
+    it = block->planes.find(z);
   }
-#endif
-  for (; i < end; ++i) {
-    outptr[i] += inptr[i] * filterValue;
+  return &it->second[size_t(y - Y0) * _blockW] - X0;
+}
+
+void Convolve::fftEngine(int y, int x, int r, ChannelMask channels, Row& row, float** outptrs)
+{
+  const int by = (y - _outArea.y()) / _blockH;
+  foreach (z, channels) {
+    const Kernel* k = kernel(z);
+    if (!k) {
+      row.erase(z);
+      continue;
+    }
+    if (y < _outArea.y() || y >= _outArea.t()) {
+      memset(outptrs[z] + x, 0, (r - x) * sizeof(float));
+      continue;
+    }
+
+    // copy from each block the span crosses, black outside the requested area
+    for (int X = x; X < r; ) {
+      if (X < _outArea.x() || X >= _outArea.r()) {
+        outptrs[z][X++] = 0;
+        continue;
+      }
+      const int bx = (X - _outArea.x()) / _blockW;
+      const int end = std::min(std::min(r, _outArea.r()), _outArea.x() + (bx + 1) * _blockW);
+      const float* blockptr = fftBlockRow(*k, bx, by, y, z);
+      if (!blockptr)
+        return;
+      memcpy(outptrs[z] + X, blockptr + X, (end - X) * sizeof(float));
+      X = end;
+    }
   }
 }
 
@@ -192,16 +735,59 @@ Iop* Convolve::inputToRead() const
   return &input1();
 }
 
-template<class TileType> void Convolve::doEngine(int y, int x, int r, ChannelMask channels, Row& row)
+/*! The row ring of the calling thread, set up for rows x..r of channels,
+   or null if it would take the rings of all the threads over
+   kRowRingMaxBytes.
+ */
+RowRing* Convolve::rowRing(int x, int r, ChannelMask channels)
 {
+  int channelCount = 0;
+  foreach (z, channels)
+    channelCount++;
+  const size_t bytes = size_t(filterHeight) * channelCount * (r - x) * sizeof(float);
+
+  RowRing* ring;
+  {
+    Guard guard(_rowRingsLock);
+    std::unique_ptr<RowRing>& entry = _rowRings[getThreadID()];
+    if (entry && entry->matches(x, r, filterHeight, channels))
+      return entry.get();
+
+    const size_t held = entry ? entry->storage.size() * sizeof(float) : 0;
+    if (_rowRingBytes - held + bytes > kRowRingMaxBytes) {
+      // give the memory back for the threads whose rings do fit
+      _rowRingBytes -= held;
+      _rowRings.erase(getThreadID());
+      return nullptr;
+    }
+    _rowRingBytes += bytes - held;
+    if (!entry)
+      entry.reset(new RowRing);
+    ring = entry.get();
+  }
+  ring->reset(x, r, filterHeight, channels);
+  return ring;
+}
 
-  // Get the entire convolution matrix:
-  TileType tile(input1(), channel ? channel : channels);
+void Convolve::clearRowRings()
+{
+  Guard guard(_rowRingsLock);
+  _rowRings.clear();
+  _rowRingBytes = 0;
+}
 
-  // If aborted is true, the tile is no good, so quit without looking at it:
-  if (aborted())
-    return;
+void Convolve::_close()
+{
+  clearRowRings();
+  Guard guard(_fftBlocksLock);
+  _fftBlocks.clear();
+}
 
+/*! Multiply-add every non-zero entry of the matrix into the output row.
+   Input rows that meet no non-zero entry in any channel are not fetched.
+ */
+void Convolve::directEngine(int y, int x, int r, ChannelMask channels, Row& row, float** outptrs)
+{
   // Account for filter width and height when processing pixel at the edges.
   // This is consistent with the logic in DD::Image::Convolve and works correctly
   // whether a filter dimension is odd or even.
@@ -211,59 +797,140 @@ template<class TileType> void Convolve::doEngine(int y, int x, int r, ChannelMas
 
   Row inrow( x - leftOffset, r + rightOffset );
 
-  float* outptrs[Chan_Last + 1];
-  foreach (z, channels) {
-    outptrs[z] = row.writable(z);
-    memset(outptrs[z] + x, 0, (r - x) * sizeof(float));
-  }
-  
   const int inX = x - leftOffset;
   const int inY = y - bottomOffset;
   const int inR = r + rightOffset;
-  const int inT = y - bottomOffset + tile.h();
+  const int inT = y - bottomOffset + filterHeight;
   // Create an Interest on input0
   Interest interest(input0(), inX, inY, inR, inT, channels);
   // We don't want to require any memory to be held in the cache but prefer to use the Interest as a hint.
   // Unlock directly so that the memory can be freed if necessary.
   interest.unlock();
 
-  const int fx0 = tile.x();
-  const int fxr = tile.r();
-  for (int Y = 0; Y < tile.h(); Y++) {
-    const int fy = tile.t() - Y - 1;
-    input0().get( inY + Y, inX, inR, channels, inrow );
+  const Kernel* kernels[Chan_Last + 1];
+  foreach (z, channels) {
+    kernels[z] = kernel(z);
+    if (!kernels[z])
+      row.erase(z);
+  }
+
+  RowRing* ring = rowRing(inX, inR, channels);
+
+  for (int Y = 0; Y < filterHeight; Y++) {
+    bool needed = false;
+    foreach (z, channels) {
+      if (kernels[z] && kernels[z]->rowStart[Y] != kernels[z]->rowStart[Y + 1])
+        needed = true;
+    }
+    if (!needed)
+      continue;
+
+    if (ring)
+      ring->fetch(input0(), inY + Y, inrow);
+    else
+      input0().get( inY + Y, inX, inR, channels, inrow );
+    if (aborted())
+      return;
     foreach (z, channels) {
-      Channel z1 = channel ? channel : z;
-      if (!(tile.channels() & z1)) {
-        row.erase(z);
+      const Kernel* k = kernels[z];
+      const float* inptr = ring ? ring->channelRow(inY + Y, z) : inrow.is_zero(z) ? nullptr : inrow[z];
+      if (!k || !inptr)
         continue;
-      }
-      typename TileType::RowPtr filterptr = tile[z1][fy];
-      if (!inrow.is_zero(z)) {
-        float* outptr = outptrs[z];
-        const float* inptr = inrow[z] - leftOffset;
-        for (int counter = fxr - 1; counter >= fx0; --counter) {
-          float f = filterptr[counter];
-          if (f) {
-            //Attempt to hand SSE this inner loop.
-            FnConvolve(outptr, inptr, f, x, r);
-            //Old version is in here.
-            //for (int xx=x; xx<r; ++xx)
-            //{
-            //  outptr[xx] += inptr[xx] * f;
-            //}
-          }
-          inptr++;
-        }
-      }
+      float* outptr = outptrs[z];
+      inptr -= leftOffset;
+      const int first = k->rowStart[Y];
+      _convolveTaps(outptr, inptr, k->taps.data() + first, k->rowStart[Y + 1] - first, x, r);
     }
+  }
+}
+
+/*! Convolve the input rows with the column factor into a temporary row,
+   then that row with the row factor. Costs filterWidth + filterHeight
+   multiply-adds per pixel instead of their product.
+ */
+void Convolve::separableEngine(int y, int x, int r, ChannelMask channels, Row& row, float** outptrs)
+{
+  const int leftOffset = (filterWidth - 1) / 2;
+  const int rightOffset = (filterWidth) / 2;
+  const int bottomOffset = (filterHeight - 1) / 2;
+
+  const int inX = x - leftOffset;
+  const int inY = y - bottomOffset;
+  const int inR = r + rightOffset;
+  const int inT = y - bottomOffset + filterHeight;
+  Interest interest(input0(), inX, inY, inR, inT, channels);
+  interest.unlock();
+
+  Row inrow(inX, inR);
+  RowRing* ring = rowRing(inX, inR, channels);
+  std::vector<float> vpass[Chan_Last + 1];
+
+  // vertical pass, input row Y meets matrix row filterHeight - 1 - Y
+  for (int Y = 0; Y < filterHeight; Y++) {
+    if (ring)
+      ring->fetch(input0(), inY + Y, inrow);
+    else
+      input0().get(inY + Y, inX, inR, channels, inrow);
     if (aborted())
       return;
+    foreach (z, channels) {
+      const Kernel* k = kernel(z);
+      if (!k)
+        continue;
+      if (vpass[z].empty())
+        vpass[z].assign(inR - inX, 0.0f);
+      const float f = k->column[filterHeight - 1 - Y];
+      const float* inptr = ring ? ring->channelRow(inY + Y, z) : inrow.is_zero(z) ? nullptr : inrow[z];
+      if (f && inptr)
+        FnConvolve(&vpass[z][0] - inX, inptr, f, inX, inR);
+    }
   }
+
+  // horizontal pass, offset j meets matrix column filterWidth - 1 - j
+  foreach (z, channels) {
+    if (vpass[z].empty()) {
+      row.erase(z);
+      continue;
+    }
+    const std::vector<float>& rowFactor = kernel(z)->row;
+    const float* vptr = &vpass[z][0] - inX;
+    float* outptr = outptrs[z];
+    for (int j = 0; j < filterWidth; j++) {
+      const float f = rowFactor[filterWidth - 1 - j];
+      if (f)
+        FnConvolve(outptr, vptr - leftOffset + j, f, x, r);
+    }
+  }
+}
+
+template<class TileType> void Convolve::doEngine(int y, int x, int r, ChannelMask channels, Row& row)
+{
+  if (!prepareMatrix()) {
+    row.erase(channels);
+    return;
+  }
+
+  float* outptrs[Chan_Last + 1];
+  foreach (z, channels) {
+    outptrs[z] = row.writable(z);
+    memset(outptrs[z] + x, 0, (r - x) * sizeof(float));
+  }
+
+  if (_useSeparable)
+    separableEngine(y, x, r, channels, row, outptrs);
+  else if (_useFFT)
+    fftEngine(y, x, r, channels, row, outptrs);
+  else
+    directEngine(y, x, r, channels, row, outptrs);
+  if (aborted())
+    return;
+
   if (K_normalize) {
-    generateSum(tile, channels);
     foreach (z, channels) {
-      float f = 1 / _sum[z];
+      const Kernel* k = kernel(z);
+      if (!k)
+        continue;
+      float f = 1 / k->sum;
       if (f != 1) {
         float* outptr = outptrs[z];
         for (int xx = x; xx < r; xx++)
@@ -0,0 +1,263 @@
+// Copyright (c) 2009 The Foundry Visionmongers Ltd.  All Rights Reserved.
+
+// ConvolveTaps.h
+
+// The row kernels of Convolve's direct method. They have no DDImage
+// dependencies so that tests/ConvolveTapsTest.cpp can build them on their
+// own and check them against a plain loop.
+
+#ifndef CONVOLVETAPS_H
+#define CONVOLVETAPS_H
+
+#include <stddef.h>
+
+#ifndef FN_PROCESSOR_PPC
+  #include <xmmintrin.h>
+#endif
+
+// AVX2 and AVX-512 versions of the inner loop are compiled with target
+// attributes and picked at runtime, so the plugin still loads on any x86.
+#if !defined(FN_PROCESSOR_PPC) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define CONVOLVE_WIDE_SIMD 1
+  #include <immintrin.h>
+#endif
+
+// A non-zero matrix entry and the offset of the input pixel it multiplies.
+struct FilterTap
+{
+  int offset;
+  float value;
+};
+
+// Adds every tap into outptr[start..end), several taps at a time.
+typedef void (*ConvolveTapsFn)(float* outptr, const float* inptr, const FilterTap* taps, int count, int start, int end);
+
+// Taps kept in registers per pass over the output row:
+static const int kTapBlock = 8;
+
+static size_t GetFloatAlignOffset(const float* buffer)
+{
+  size_t alignedStart = (size_t)buffer;
+  size_t offset = alignedStart & 15;
+  if ( 0 == offset ) {
+    return 0;
+  }
+  
+  size_t startBit = 16 - offset;
+  size_t startFloat = startBit / 4;
+  return startFloat;
+}
+
+static void FnConvolve(float* outptr, const float* inptr, float filterValue, int start, int end)
+{
+  int i = start;
+#ifndef FN_PROCESSOR_PPC
+  size_t startFloat = GetFloatAlignOffset(&outptr[start]) + start;
+  // a span shorter than the distance to the alignment is all done below
+  if (startFloat > size_t(end))
+    startFloat = end;
+
+  for (; i < int(startFloat); ++i) {
+    outptr[i] += inptr[i] * filterValue;
+  }
+
+  int lastValToCpy = ((end - startFloat) / 4) * 4 + startFloat;
+  __m128 f = _mm_load_ps1(&filterValue);
+  for (; i < lastValToCpy; i += 4) {
+    __m128 input = _mm_loadu_ps(&inptr[i]);
+    __m128 output = _mm_load_ps(&outptr[i]);
+    output = _mm_add_ps(output, _mm_mul_ps(input, f));
+    _mm_store_ps(&outptr[i], output);
+  }
+#endif
+  for (; i < end; ++i) {
+    outptr[i] += inptr[i] * filterValue;
+  }
+}
+
+/*! The output row is loaded and stored once per block of N taps rather
+   than once per tap. Four vectors of output are done at a time so there
+   are four independent chains of multiply-adds.
+ */
+template<int N> static inline void ConvolveTapBlockScalar(float* outptr, const float* inptr, const FilterTap* taps, int start, int end)
+{
+  for (int i = start; i < end; ++i) {
+    float acc = outptr[i];
+    for (int k = 0; k < N; ++k)
+      acc += inptr[taps[k].offset + i] * taps[k].value;
+    outptr[i] = acc;
+  }
+}
+
+// Splits count taps into blocks of kTapBlock, then 4, 2 and 1.
+#define CONVOLVE_TAPS_BLOCKED(BLOCK)                                  \
+  int t = 0;                                                          \
+  for (; t + kTapBlock <= count; t += kTapBlock)                      \
+    BLOCK<kTapBlock>(outptr, inptr, taps + t, start, end);            \
+  if (count - t >= 4) {                                               \
+    BLOCK<4>(outptr, inptr, taps + t, start, end);                    \
+    t += 4;                                                           \
+  }                                                                   \
+  if (count - t >= 2) {                                               \
+    BLOCK<2>(outptr, inptr, taps + t, start, end);                    \
+    t += 2;                                                           \
+  }                                                                   \
+  if (count - t >= 1)                                                 \
+    BLOCK<1>(outptr, inptr, taps + t, start, end);
+
+static inline void FnConvolveTapsScalar(float* outptr, const float* inptr, const FilterTap* taps, int count, int start, int end)
+{
+  CONVOLVE_TAPS_BLOCKED(ConvolveTapBlockScalar)
+}
+
+#ifndef FN_PROCESSOR_PPC
+template<int N> static inline void ConvolveTapBlockSSE(float* outptr, const float* inptr, const FilterTap* taps, int start, int end)
+{
+  __m128 f[N];
+  const float* in[N];
+  for (int k = 0; k < N; ++k) {
+    f[k] = _mm_set1_ps(taps[k].value);
+    in[k] = inptr + taps[k].offset;
+  }
+
+  int i = start;
+  for (; i + 16 <= end; i += 16) {
+    __m128 a0 = _mm_loadu_ps(outptr + i);
+    __m128 a1 = _mm_loadu_ps(outptr + i + 4);
+    __m128 a2 = _mm_loadu_ps(outptr + i + 8);
+    __m128 a3 = _mm_loadu_ps(outptr + i + 12);
+    for (int k = 0; k < N; ++k) {
+      a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(in[k] + i), f[k]));
+      a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(in[k] + i + 4), f[k]));
+      a2 = _mm_add_ps(a2, _mm_mul_ps(_mm_loadu_ps(in[k] + i + 8), f[k]));
+      a3 = _mm_add_ps(a3, _mm_mul_ps(_mm_loadu_ps(in[k] + i + 12), f[k]));
+    }
+    _mm_storeu_ps(outptr + i, a0);
+    _mm_storeu_ps(outptr + i + 4, a1);
+    _mm_storeu_ps(outptr + i + 8, a2);
+    _mm_storeu_ps(outptr + i + 12, a3);
+  }
+  for (; i + 4 <= end; i += 4) {
+    __m128 a = _mm_loadu_ps(outptr + i);
+    for (int k = 0; k < N; ++k)
+      a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(in[k] + i), f[k]));
+    _mm_storeu_ps(outptr + i, a);
+  }
+  ConvolveTapBlockScalar<N>(outptr, inptr, taps, i, end);
+}
+
+static void FnConvolveTapsSSE(float* outptr, const float* inptr, const FilterTap* taps, int count, int start, int end)
+{
+  CONVOLVE_TAPS_BLOCKED(ConvolveTapBlockSSE)
+}
+#endif
+
+#ifdef CONVOLVE_WIDE_SIMD
+template<int N> __attribute__((target("avx2,fma"))) static inline void ConvolveTapBlockAVX2(float* outptr, const float* inptr, const FilterTap* taps, int start, int end)
+{
+  __m256 f[N];
+  const float* in[N];
+  for (int k = 0; k < N; ++k) {
+    f[k] = _mm256_set1_ps(taps[k].value);
+    in[k] = inptr + taps[k].offset;
+  }
+
+  int i = start;
+  for (; i + 32 <= end; i += 32) {
+    __m256 a0 = _mm256_loadu_ps(outptr + i);
+    __m256 a1 = _mm256_loadu_ps(outptr + i + 8);
+    __m256 a2 = _mm256_loadu_ps(outptr + i + 16);
+    __m256 a3 = _mm256_loadu_ps(outptr + i + 24);
+    for (int k = 0; k < N; ++k) {
+      a0 = _mm256_fmadd_ps(_mm256_loadu_ps(in[k] + i), f[k], a0);
+      a1 = _mm256_fmadd_ps(_mm256_loadu_ps(in[k] + i + 8), f[k], a1);
+      a2 = _mm256_fmadd_ps(_mm256_loadu_ps(in[k] + i + 16), f[k], a2);
+      a3 = _mm256_fmadd_ps(_mm256_loadu_ps(in[k] + i + 24), f[k], a3);
+    }
+    _mm256_storeu_ps(outptr + i, a0);
+    _mm256_storeu_ps(outptr + i + 8, a1);
+    _mm256_storeu_ps(outptr + i + 16, a2);
+    _mm256_storeu_ps(outptr + i + 24, a3);
+  }
+  for (; i + 8 <= end; i += 8) {
+    __m256 a = _mm256_loadu_ps(outptr + i);
+    for (int k = 0; k < N; ++k)
+      a = _mm256_fmadd_ps(_mm256_loadu_ps(in[k] + i), f[k], a);
+    _mm256_storeu_ps(outptr + i, a);
+  }
+  ConvolveTapBlockScalar<N>(outptr, inptr, taps, i, end);
+}
+
+__attribute__((target("avx2,fma"))) static void FnConvolveTapsAVX2(float* outptr, const float* inptr, const FilterTap* taps, int count, int start, int end)
+{
+  CONVOLVE_TAPS_BLOCKED(ConvolveTapBlockAVX2)
+}
+
+template<int N> __attribute__((target("avx512f"))) static inline void ConvolveTapBlockAVX512(float* outptr, const float* inptr, const FilterTap* taps, int start, int end)
+{
+  __m512 f[N];
+  const float* in[N];
+  for (int k = 0; k < N; ++k) {
+    f[k] = _mm512_set1_ps(taps[k].value);
+    in[k] = inptr + taps[k].offset;
+  }
+
+  int i = start;
+  for (; i + 64 <= end; i += 64) {
+    __m512 a0 = _mm512_loadu_ps(outptr + i);
+    __m512 a1 = _mm512_loadu_ps(outptr + i + 16);
+    __m512 a2 = _mm512_loadu_ps(outptr + i + 32);
+    __m512 a3 = _mm512_loadu_ps(outptr + i + 48);
+    for (int k = 0; k < N; ++k) {
+      a0 = _mm512_fmadd_ps(_mm512_loadu_ps(in[k] + i), f[k], a0);
+      a1 = _mm512_fmadd_ps(_mm512_loadu_ps(in[k] + i + 16), f[k], a1);
+      a2 = _mm512_fmadd_ps(_mm512_loadu_ps(in[k] + i + 32), f[k], a2);
+      a3 = _mm512_fmadd_ps(_mm512_loadu_ps(in[k] + i + 48), f[k], a3);
+    }
+    _mm512_storeu_ps(outptr + i, a0);
+    _mm512_storeu_ps(outptr + i + 16, a1);
+    _mm512_storeu_ps(outptr + i + 32, a2);
+    _mm512_storeu_ps(outptr + i + 48, a3);
+  }
+  // the last partial vector is done with a mask instead of scalar code
+  for (; i < end; i += 16) {
+    const __mmask16 mask = end - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (end - i)) - 1);
+    __m512 a = _mm512_maskz_loadu_ps(mask, outptr + i);
+    for (int k = 0; k < N; ++k)
+      a = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, in[k] + i), f[k], a);
+    _mm512_mask_storeu_ps(outptr + i, mask, a);
+  }
+}
+
+__attribute__((target("avx512f"))) static void FnConvolveTapsAVX512(float* outptr, const float* inptr, const FilterTap* taps, int count, int start, int end)
+{
+  CONVOLVE_TAPS_BLOCKED(ConvolveTapBlockAVX512)
+}
+#endif
+
+#undef CONVOLVE_TAPS_BLOCKED
+
+/*! The widest version of the multi-tap loop this processor runs. */
+static ConvolveTapsFn SelectConvolveTaps(const char** name)
+{
+#ifdef CONVOLVE_WIDE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    *name = "avx512";
+    return FnConvolveTapsAVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    *name = "avx2";
+    return FnConvolveTapsAVX2;
+  }
+#endif
+#ifndef FN_PROCESSOR_PPC
+  *name = "sse";
+  return FnConvolveTapsSSE;
+#else
+  *name = "scalar";
+  return FnConvolveTapsScalar;
+#endif
+}
+
+#endif
@@ -7,7 +7,15 @@ static const char* HELP =
   "Box Morphological Filter\n\n"
 
   "Maximum (or minimum) of a rectangular area around each pixel. This "
-  "can be used to grow or shrink mattes.";
+  "can be used to grow or shrink mattes.\n\n"
+
+  "The disk shape instead thresholds each channel and grows or shrinks it "
+  "by an ellipse of the given size, with an antialiased edge. It uses a "
+  "distance transform, so it costs the same whatever the size.";
+
+static const char* const shapeNames[] = { "box", "disk", 0 };
+
+enum { SHAPE_BOX, SHAPE_DISK };
 
 /*
 
@@ -30,14 +38,73 @@ static const char* HELP =
 #include "DDImage/Knobs.h"
 #include "DDImage/Tile.h"
 #include "DDImage/DDMath.h"
+#include "DDImage/Thread.h"
+#include <float.h>
 #include <stdio.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
 
 using namespace DD::Image;
 
+// Vertical windows shorter than this many rows are scanned row by row,
+// which is cheaper than building the block cache for them:
+static const int kMinBlockSize = 4;
+
+// Squared distance standing for "no pixel in reach":
+static const double kFar = 1e30;
+
+// Narrowest band of columns the disk shape's column pass gives a thread:
+static const int kMinColumnBand = 64;
+
+/*! Lower envelope of the parabolas (p - q)^2 + f[q] over the q = 0..n-1
+   where f[q] is less than kFar, evaluated at p = first..first+count-1.
+   This is the 1D squared distance transform of Felzenszwalb and
+   Huttenlocher, linear in n + count. v and z are scratch space.
+ */
+static void distance_transform(const double* f, int n, int first, int count, double* d,
+                               std::vector<int>& v, std::vector<double>& z)
+{
+  v.resize(n);
+  z.resize(n + 1);
+  int k = -1;
+  for (int q = 0; q < n; q++) {
+    if (f[q] >= kFar)
+      continue;
+    double s = -kFar;
+    while (k >= 0) {
+      s = ((f[q] + double(q) * q) - (f[v[k]] + double(v[k]) * v[k])) / (2.0 * (q - v[k]));
+      if (s > z[k])
+        break;
+      k--;
+    }
+    k++;
+    v[k] = q;
+    z[k] = k ? s : -kFar;
+    z[k + 1] = kFar;
+  }
+
+  if (k < 0) {
+    for (int i = 0; i < count; i++)
+      d[i] = kFar;
+    return;
+  }
+  int j = 0;
+  for (int i = 0; i < count; i++) {
+    const double p = first + i;
+    while (z[j + 1] < p)
+      j++;
+    d[i] = (p - v[j]) * (p - v[j]) + f[v[j]];
+  }
+}
+
 class Dilate : public Iop
 {
   // Where the knob stores it's values:
   double w, h;
+  int shape;
+  float threshold;
 
   // arguments for the horizontal pass:
   int h_size;
@@ -47,11 +114,56 @@ class Dilate : public Iop
   int v_size;
   int v_do_min;
 
+  // The vertical pass splits the input rows into blocks of 2*v_size+1
+  // (van Herk / Gil-Werman). For every row a block holds the min or max
+  // from the start of the block down to it (prefix) and from it to the end
+  // of the block (suffix). Any window of 2*v_size+1 rows is then the
+  // suffix of one block and the prefix of the next. Blocks are filled by
+  // whichever engine thread needs them first and then only read.
+  struct Block
+  {
+    Lock lock;
+    bool ready;
+    int y, t;       // rows of the block that are inside _area
+    std::map<Channel, std::vector<float> > prefix, suffix;
+    Block() : ready(false), y(0), t(0) {}
+  };
+
+  // Input area the blocks cover: the requested area clipped to the input bbox.
+  Box _area;
+  ChannelSet _blockChannels;
+  std::map<int, std::unique_ptr<Block> > _blocks;
+  Lock _blocksLock;
+
+  // The disk shape first finds, for every pixel of _area, how many rows away
+  // the nearest thresholded pixel of its column is. This is done once for
+  // the whole area, by the first engine thread to need it and the helper
+  // threads it spawns, each taking bands of columns.
+  struct Columns
+  {
+    Lock lock;
+    bool ready;
+    std::map<Channel, std::vector<int> > distance;
+    int bandWidth, bands;
+    std::atomic<int> nextBand;
+    Columns() : ready(false), bandWidth(0), bands(0), nextBand(0) {}
+  };
+  Columns _columns;
+
+  // ellipse radii, and whether the disk shape shrinks
+  double disk_w, disk_h;
+  bool disk_erode;
+
 public:
 
   Dilate(Node* node) : Iop(node)
   {
     w = h = 0;
+    shape = SHAPE_BOX;
+    threshold = 0.5f;
+    h_size = h_do_min = v_size = v_do_min = 0;
+    disk_w = disk_h = 0;
+    disk_erode = false;
   }
 
   void _validate(bool for_real) override
@@ -60,12 +172,23 @@ public:
     h_do_min = w < 0;
     v_size = int(fabs(h) + .5);
     v_do_min = h < 0;
+    if (shape == SHAPE_DISK) {
+      // the antialiased edge reaches half a pixel past the ellipse
+      disk_w = fabs(w);
+      disk_h = fabs(h);
+      disk_erode = w < 0 || h < 0;
+      h_size = disk_w > 0 ? int(ceil(disk_w + .5)) : 0;
+      v_size = disk_h > 0 ? int(ceil(disk_h + .5)) : 0;
+    }
     copy_info();
     info_.y(info_.y() - v_size);
     info_.t(info_.t() + v_size);
     info_.x(info_.x() - h_size);
     info_.r(info_.r() + h_size);
     set_out_channels(h_size || v_size ? Mask_All : Mask_None);
+    Guard guard(_blocksLock);
+    _blocks.clear();
+    _columns.ready = false;
   }
 
   void _request(int x, int y, int r, int t, ChannelMask channels, int count) override
@@ -75,6 +198,294 @@ public:
     y -= v_size;
     t += v_size;
     input0().request(x, y, r, t, channels, count);
+
+    // the blocks only ever read what was requested, clipped to the input bbox
+    Box area(x, y, r, t);
+    area.intersect(input0().info());
+    ChannelSet blockChannels = channels;
+    blockChannels &= input0().info().channels();
+
+    Guard guard(_blocksLock);
+    _area = area;
+    _blockChannels = blockChannels;
+    _blocks.clear();
+    _columns.ready = false;
+  }
+
+  // Return the block holding input row y, filling it if no other thread has
+  // done so yet. Returns 0 if filling was aborted.
+  Block* get_block(int y)
+  {
+    const int length = 2 * v_size + 1;
+    // floor division so rows below 0 land in negative blocks
+    const int index = y >= 0 ? y / length : -((-y + length - 1) / length);
+
+    Block* block;
+    {
+      Guard guard(_blocksLock);
+      std::unique_ptr<Block>& slot = _blocks[index];
+      if (!slot) {
+        slot.reset(new Block);
+        slot->y = std::max(index * length, _area.y());
+        slot->t = std::min((index + 1) * length, _area.t());
+      }
+      block = slot.get();
+    }
+
+    Guard guard(block->lock);
+    if (!block->ready && !fill_block(*block))
+      return 0;
+    return block;
+  }
+
+  bool fill_block(Block& block)
+  {
+    if (block.y >= block.t || _area.x() >= _area.r()) {
+      block.ready = true;
+      return true;
+    }
+
+    Tile tile(input0(), _area.x(), block.y, _area.r(), block.t, _blockChannels);
+    if (aborted())
+      return false;
+
+    const int width = _area.r() - _area.x();
+    const int rows = block.t - block.y;
+    foreach (z, _blockChannels) {
+      std::vector<float>& prefix = block.prefix[z];
+      std::vector<float>& suffix = block.suffix[z];
+      prefix.assign(size_t(rows) * width, 0.0f);
+      suffix.assign(size_t(rows) * width, 0.0f);
+      if (!tile.valid() || !intersect(tile.channels(), z))
+        continue;
+
+      Tile::LinePointers tlp = tile[z];
+      for (int i = 0; i < rows; i++) {
+        const float* in = &tlp[block.y + i][_area.x()];
+        float* p = &prefix[size_t(i) * width];
+        if (i == 0) {
+          memcpy(p, in, width * sizeof(float));
+          continue;
+        }
+        const float* q = p - width;
+        for (int X = 0; X < width; X++)
+          p[X] = v_do_min ? std::min(q[X], in[X]) : std::max(q[X], in[X]);
+      }
+      for (int i = rows - 1; i >= 0; i--) {
+        const float* in = &tlp[block.y + i][_area.x()];
+        float* s = &suffix[size_t(i) * width];
+        if (i == rows - 1) {
+          memcpy(s, in, width * sizeof(float));
+          continue;
+        }
+        const float* q = s + width;
+        for (int X = 0; X < width; X++)
+          s[X] = v_do_min ? std::min(q[X], in[X]) : std::max(q[X], in[X]);
+      }
+    }
+
+    block.ready = true;
+    return true;
+  }
+
+  // Min or max of the input rows y - v_size to y + v_size from the suffix
+  // of the block holding the top one and the prefix of the block holding the
+  // bottom one: two reads and a compare per pixel, whatever the size.
+  void get_block_vpass(int y, int x, int r, ChannelMask channels, Row& out)
+  {
+    const int a = y - v_size;
+    const int c = y + v_size;
+    Block* top = get_block(a);
+    if (!top)
+      return;
+    Block* bottom = get_block(c);
+    if (!bottom)
+      return;
+
+    // rows of the window outside _area take no part in it
+    const int sy = std::max(a, top->y);
+    const bool has_suffix = sy < top->t;
+    const int py = std::min(c, bottom->t - 1);
+    const bool has_prefix = py >= bottom->y;
+
+    const int width = _area.r() - _area.x();
+    const int left = std::max(x, _area.x());
+    const int right = std::min(r, _area.r());
+    const float neutral = v_do_min ? FLT_MAX : -FLT_MAX;
+
+    for (Channel z : channels) {
+      float* TO = out.writable(z);
+      if ((!has_suffix && !has_prefix) || left >= right || !(_blockChannels & z)) {
+        memset(&TO[x], 0, (r - x) * sizeof(float));
+        continue;
+      }
+      const float* S = has_suffix ? &top->suffix[z][size_t(sy - top->y) * width] - _area.x() : 0;
+      const float* P = has_prefix ? &bottom->prefix[z][size_t(py - bottom->y) * width] - _area.x() : 0;
+      int X;
+      for (X = left; X < right; X++) {
+        const float s = S ? S[X] : neutral;
+        const float p = P ? P[X] : neutral;
+        TO[X] = v_do_min ? std::min(s, p) : std::max(s, p);
+      }
+      // pad the ends that go outside the source:
+      for (X = x; X < left; X++)
+        TO[X] = TO[left];
+      for (X = right; X < r; X++)
+        TO[X] = TO[right - 1];
+    }
+  }
+
+  // Fill _columns if no other thread has done so yet. Returns false if
+  // filling was aborted.
+  bool get_columns()
+  {
+    Guard guard(_columns.lock);
+    if (_columns.ready)
+      return true;
+    _columns.distance.clear();
+    if (_area.x() >= _area.r() || _area.y() >= _area.t()) {
+      _columns.ready = true;
+      return true;
+    }
+
+    const int width = _area.r() - _area.x();
+    const int height = _area.t() - _area.y();
+    const int far = height + v_size + 1;
+    foreach (z, _blockChannels)
+      _columns.distance[z].assign(size_t(width) * height, far);
+
+    // a few bands per thread so a slow band does not leave the others idle
+    const int threads = std::max(1, int(Thread::numThreads));
+    const int bands = std::max(1, std::min(width / kMinColumnBand, threads * 4));
+    _columns.bandWidth = (width + bands - 1) / bands;
+    _columns.bands = (width + _columns.bandWidth - 1) / _columns.bandWidth;
+    _columns.nextBand = 0;
+
+    // one less helper than threads, this thread works too
+    const int helpers = std::min(threads - 1, _columns.bands - 1);
+    if (helpers > 0)
+      Thread::spawn(column_thread, helpers, this);
+    fill_column_bands();
+    if (helpers > 0)
+      Thread::wait(this);
+
+    if (aborted())
+      return false;
+    _columns.ready = true;
+    return true;
+  }
+
+  static void column_thread(unsigned, unsigned, void* d)
+  {
+    static_cast<Dilate*>(d)->fill_column_bands();
+  }
+
+  // Take bands of columns of _columns until there are none left. Each band
+  // reads its own tile and writes only its own columns of the distances.
+  void fill_column_bands()
+  {
+    const int width = _area.r() - _area.x();
+    const int height = _area.t() - _area.y();
+    const int far = height + v_size + 1;
+    for (int band = _columns.nextBand++; band < _columns.bands; band = _columns.nextBand++) {
+      const int bx = _area.x() + band * _columns.bandWidth;
+      const int br = std::min(bx + _columns.bandWidth, _area.r());
+      const int n = br - bx;
+      Tile tile(input0(), bx, _area.y(), br, _area.t(), _blockChannels);
+      if (aborted())
+        return;
+
+      foreach (z, _blockChannels) {
+        if (!tile.valid() || !intersect(tile.channels(), z))
+          continue;
+        // the band's columns of the first row of distances
+        int* distance = &_columns.distance.find(z)->second[bx - _area.x()];
+
+        // the pixels grown from: above threshold, or at most it when shrinking
+        Tile::LinePointers tlp = tile[z];
+        for (int i = 0; i < height; i++) {
+          const float* in = &tlp[_area.y() + i][bx];
+          int* d = distance + size_t(i) * width;
+          const int* above = i ? d - width : 0;
+          for (int X = 0; X < n; X++) {
+            const bool set = disk_erode ? !(in[X] > threshold) : in[X] > threshold;
+            d[X] = set ? 0 : above ? std::min(above[X] + 1, far) : far;
+          }
+        }
+        for (int i = height - 2; i >= 0; i--) {
+          int* d = distance + size_t(i) * width;
+          const int* below = d + width;
+          for (int X = 0; X < n; X++)
+            d[X] = std::min(d[X], std::min(below[X] + 1, far));
+        }
+      }
+    }
+  }
+
+  // The disk shape: the vertical distances of row y are turned into
+  // squared distances to the nearest pixel inside the ellipse's reach by
+  // one pass of distance_transform(), then into coverage of the grown
+  // shape. Pixels outside the input bbox are not grown from.
+  void disk_engine(int y, int x, int r, ChannelMask channels, Row& out)
+  {
+    if (!get_columns())
+      return;
+
+    // scale both axes so the ellipse becomes a circle of radius R
+    const double R = std::max(disk_w, disk_h);
+    const double sx = disk_w > 0 ? R / disk_w : 0;
+    const double sy = disk_h > 0 ? R / disk_h : 0;
+
+    const int width = _area.r() - _area.x();
+    const int lo = std::max(x - h_size, _area.x());
+    const int hi = std::min(r + h_size, _area.r());
+    // rows above or below the area are as far as the nearest edge row, plus
+    // the rows between
+    const int row = std::max(_area.y(), std::min(y, _area.t() - 1));
+    const int extra = abs(y - row);
+
+    std::vector<double> f(std::max(hi - lo, 0));
+    std::vector<double> d(r - x);
+    std::vector<int> v;
+    std::vector<double> envelope;
+
+    for (Channel z : channels) {
+      float* TO = out.writable(z);
+      std::map<Channel, std::vector<int> >::const_iterator columns = _columns.distance.find(z);
+      if (lo >= hi || columns == _columns.distance.end()) {
+        memset(&TO[x], 0, (r - x) * sizeof(float));
+        continue;
+      }
+
+      const int* distance = &columns->second[size_t(row - _area.y()) * width] - _area.x();
+      for (int X = lo; X < hi; X++) {
+        const int g = distance[X] + extra;
+        if (g > v_size || (g && !sy))
+          f[X - lo] = kFar;
+        else
+          f[X - lo] = sy * sy * g * g;
+      }
+
+      if (sx) {
+        // d = sx^2 * min((p - q)^2 + f[q] / sx^2)
+        for (double& value : f)
+          if (value < kFar)
+            value /= sx * sx;
+        distance_transform(&f[0], hi - lo, x - lo, r - x, &d[0], v, envelope);
+        for (double& value : d)
+          if (value < kFar)
+            value *= sx * sx;
+      }
+      else {
+        for (int X = x; X < r; X++)
+          d[X - x] = X >= lo && X < hi ? f[X - lo] : kFar;
+      }
+
+      for (int X = x; X < r; X++) {
+        const double cover = d[X - x] >= kFar ? 0 : std::max(0.0, std::min(1.0, R + .5 - sqrt(d[X - x])));
+        TO[X] = float(disk_erode ? 1 - cover : cover);
+      }
+    }
   }
 
   // Find the minimum of all the input rows:
@@ -84,6 +495,10 @@ public:
       input0().get(y, x, r, channels, out);
       return;
     }
+    if (2 * v_size + 1 >= kMinBlockSize) {
+      get_block_vpass(y, x, r, channels, out);
+      return;
+    }
     // Get the input region we want to look at:
     Tile tile(input0(), x, y - v_size, r, y + v_size + 1, channels);
 
@@ -143,6 +558,10 @@ public:
   // The engine does the horizontal minimum pass:
   void engine(int y, int x, int r, ChannelMask channels, Row& out) override
   {
+    if (shape == SHAPE_DISK) {
+      disk_engine(y, x, r, channels, out);
+      return;
+    }
     if (h_size) {
       Row in(x - h_size, r + h_size);
       get_vpass(y, x - h_size, r + h_size, channels, in);
@@ -220,6 +639,13 @@ public:
   void knobs(Knob_Callback f) override
   {
     WH_knob(f, &w, IRange(-100, 100), "size");
+    Enumeration_knob(f, &shape, shapeNames, "shape", "shape");
+    Tooltip(f, "box: maximum (or minimum) of the rectangle, on the image itself.\n"
+               "disk: threshold each channel and grow it by an ellipse of the "
+               "size, or shrink it if either size is negative. The result is a "
+               "matte with an antialiased edge.");
+    Float_knob(f, &threshold, "threshold", "threshold");
+    Tooltip(f, "In disk mode, pixels above this value are inside the matte.");
   }
 
   static const Op::Description d;
@@ -0,0 +1,413 @@
+// Copyright (c) 2009 The Foundry Visionmongers Ltd.  All Rights Reserved.
+
+// DpxUnpack.h
+
+// Vector unpackers used by dpxReader. They have no DDImage dependencies so
+// that tests/DpxUnpackTest.cpp can build them on their own. U8, U16 and U32
+// must be defined before this is included, as DPXimage.h does.
+
+#ifndef DPXUNPACK_H
+#define DPXUNPACK_H
+
+// Vector unpackers for the filled and packed 10 and 12 bit layouts, used by
+// the planar decoders and read_element16(). Each one byte swaps, shifts,
+// masks and scales a block of words in registers, and returns how much it
+// consumed.
+// The scalar loops after each call finish the rest, and do all the work on
+// CPUs without SSSE3. The SSSE3 and AVX2 versions are compiled with target
+// attributes and picked at runtime, so the plugin still loads on any x86.
+#if !defined(FN_PROCESSOR_PPC) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define DPX_WIDE_SIMD 1
+  #include <immintrin.h>
+#endif
+
+struct DpxUnpackers
+{
+  const char* name;
+  //! 10 bit filled words to 3 U16 components each, or 4 if addAlpha is set.
+  int (*filled10)(const U32* src, int words, const int shifts[3], bool flipEndian, bool scale, bool addAlpha, U16 alpha, U16* dst);
+  //! 10 bit filled words to GL_UNSIGNED_INT_2_10_10_10_REV words, alpha already in the top 2 bits.
+  int (*filled10Rev)(const U32* src, int words, const int shifts[3], bool flipEndian, U32 alpha, U32* dst);
+  //! 12 bit filled components, one per 16 bits, to U16 components. May work in place.
+  int (*filled12)(const U16* src, int components, int shift, bool flipEndian, bool scale, U16* dst);
+  //! 12 bit filled rgb pixels to U16 rgba pixels.
+  int (*filled12Rgba)(const U16* src, int pixels, int shift, bool flipEndian, bool scale, U16 alpha, U16* dst);
+  //! 10 or 12 bit packed components to U16 components, rgb to rgba if addAlpha is set. Reads no
+  //! further than src + words, returns the components done, a multiple of 3 with addAlpha.
+  int (*packed)(const U32* src, int words, int bits, bool flipEndian, bool scale, bool addAlpha, U16 alpha, int components, U16* dst);
+};
+
+static int DpxFilled10None(const U32*, int, const int*, bool, bool, bool, U16, U16*) { return 0; }
+static int DpxFilled10RevNone(const U32*, int, const int*, bool, U32, U32*) { return 0; }
+static int DpxFilled12None(const U16*, int, int, bool, bool, U16*) { return 0; }
+static int DpxFilled12RgbaNone(const U16*, int, int, bool, bool, U16, U16*) { return 0; }
+static int DpxPackedNone(const U32*, int, int, bool, bool, bool, U16, int, U16*) { return 0; }
+
+#ifdef DPX_WIDE_SIMD
+// pshufb masks putting the bytes of each 32 or 16 bit word in host order.
+__attribute__((target("ssse3"))) static inline __m128i DpxWordOrder(bool flipEndian)
+{
+  return flipEndian ? _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)
+                    : _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+__attribute__((target("ssse3"))) static inline __m128i DpxHalfWordOrder(bool flipEndian)
+{
+  return flipEndian ? _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+                    : _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+// Spreads 3 rgb half words of each of two pixels over rgba, leaving a zero.
+__attribute__((target("ssse3"))) static inline __m128i DpxRgbToRgbaOrder(bool flipEndian)
+{
+  return flipEndian ? _mm_setr_epi8(1, 0, 3, 2, 5, 4, -1, -1, 7, 6, 9, 8, 11, 10, -1, -1)
+                    : _mm_setr_epi8(0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1);
+}
+
+// Drops the alpha of two rgba U16 pixels, leaving 12 bytes of rgb.
+__attribute__((target("ssse3"))) static inline __m128i DpxRgbaToRgbOrder()
+{
+  return _mm_setr_epi8(0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+}
+
+// (v << 6) | (v >> 4) and (v << 4) | (v >> 8), as SCALE_BITS_TO_DEST_RANGE does.
+__attribute__((target("ssse3"))) static inline __m128i DpxScale10(__m128i v)
+{
+  return _mm_or_si128(_mm_slli_epi32(v, 6), _mm_srli_epi32(v, 4));
+}
+
+__attribute__((target("ssse3"))) static inline __m128i DpxScale12(__m128i v)
+{
+  return _mm_or_si128(_mm_slli_epi16(v, 4), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2"))) static inline __m256i DpxScale10AVX2(__m256i v)
+{
+  return _mm256_or_si256(_mm256_slli_epi32(v, 6), _mm256_srli_epi32(v, 4));
+}
+
+__attribute__((target("avx2"))) static inline __m256i DpxScale12AVX2(__m256i v)
+{
+  return _mm256_or_si256(_mm256_slli_epi16(v, 4), _mm256_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2"))) static inline __m256i DpxBothLanes(__m128i v)
+{
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(v), v, 1);
+}
+
+// Stores the rgb of four rgba pixels, two in each of a and b, as 24 bytes.
+__attribute__((target("ssse3"))) static inline void DpxStoreRgb(U16* dst, __m128i a, __m128i b)
+{
+  const __m128i rgb = DpxRgbaToRgbOrder();
+  a = _mm_shuffle_epi8(a, rgb);
+  b = _mm_shuffle_epi8(b, rgb);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_or_si128(a, _mm_slli_si128(b, 12)));
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 8), _mm_srli_si128(b, 4));
+}
+
+__attribute__((target("ssse3"))) static int DpxFilled10SSSE3(const U32* src, int words, const int shifts[3], bool flipEndian, bool scale, bool addAlpha, U16 alpha, U16* dst)
+{
+  const __m128i order = DpxWordOrder(flipEndian);
+  const __m128i mask = _mm_set1_epi32(0x3ff);
+  const __m128i s1 = _mm_cvtsi32_si128(shifts[0]);
+  const __m128i s2 = _mm_cvtsi32_si128(shifts[1]);
+  const __m128i s3 = _mm_cvtsi32_si128(shifts[2]);
+  const __m128i alphaHigh = _mm_set1_epi32(int(U32(alpha) << 16));
+  int i = 0;
+  for (; i + 4 <= words; i += 4) {
+    const __m128i w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), order);
+    __m128i c1 = _mm_and_si128(_mm_srl_epi32(w, s1), mask);
+    __m128i c2 = _mm_and_si128(_mm_srl_epi32(w, s2), mask);
+    __m128i c3 = _mm_and_si128(_mm_srl_epi32(w, s3), mask);
+    if (scale) {
+      c1 = DpxScale10(c1);
+      c2 = DpxScale10(c2);
+      c3 = DpxScale10(c3);
+    }
+    // rg and ba pairs of U16, then interleaved into rgba pixels
+    const __m128i rg = _mm_or_si128(c1, _mm_slli_epi32(c2, 16));
+    const __m128i ba = _mm_or_si128(c3, alphaHigh);
+    const __m128i p01 = _mm_unpacklo_epi32(rg, ba);
+    const __m128i p23 = _mm_unpackhi_epi32(rg, ba);
+    if (addAlpha) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), p01);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8), p23);
+      dst += 16;
+    }
+    else {
+      DpxStoreRgb(dst, p01, p23);
+      dst += 12;
+    }
+  }
+  return i;
+}
+
+__attribute__((target("ssse3"))) static int DpxFilled10RevSSSE3(const U32* src, int words, const int shifts[3], bool flipEndian, U32 alpha, U32* dst)
+{
+  const __m128i order = DpxWordOrder(flipEndian);
+  const __m128i mask = _mm_set1_epi32(0x3ff);
+  const __m128i s1 = _mm_cvtsi32_si128(shifts[0]);
+  const __m128i s2 = _mm_cvtsi32_si128(shifts[1]);
+  const __m128i s3 = _mm_cvtsi32_si128(shifts[2]);
+  const __m128i a = _mm_set1_epi32(int(alpha));
+  int i = 0;
+  for (; i + 4 <= words; i += 4) {
+    const __m128i w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), order);
+    __m128i out = _mm_or_si128(_mm_and_si128(_mm_srl_epi32(w, s1), mask), a);
+    out = _mm_or_si128(out, _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(w, s2), mask), 10));
+    out = _mm_or_si128(out, _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(w, s3), mask), 20));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+  }
+  return i;
+}
+
+__attribute__((target("ssse3"))) static int DpxFilled12SSSE3(const U16* src, int components, int shift, bool flipEndian, bool scale, U16* dst)
+{
+  const __m128i order = DpxHalfWordOrder(flipEndian);
+  const __m128i mask = _mm_set1_epi16(0xfff);
+  const __m128i s = _mm_cvtsi32_si128(shift);
+  int i = 0;
+  for (; i + 8 <= components; i += 8) {
+    const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), order);
+    __m128i c = _mm_and_si128(_mm_srl_epi16(v, s), mask);
+    if (scale)
+      c = DpxScale12(c);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), c);
+  }
+  return i;
+}
+
+__attribute__((target("ssse3"))) static int DpxFilled12RgbaSSSE3(const U16* src, int pixels, int shift, bool flipEndian, bool scale, U16 alpha, U16* dst)
+{
+  const __m128i order = DpxRgbToRgbaOrder(flipEndian);
+  const __m128i mask = _mm_set1_epi16(0xfff);
+  const __m128i s = _mm_cvtsi32_si128(shift);
+  const __m128i a = _mm_setr_epi16(0, 0, 0, short(alpha), 0, 0, 0, short(alpha));
+  int i = 0;
+  // two pixels at a time, but the 16 byte load reaches into a third
+  for (; i + 3 <= pixels; i += 2) {
+    const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i)), order);
+    __m128i c = _mm_and_si128(_mm_srl_epi16(v, s), mask);
+    if (scale)
+      c = DpxScale12(c);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i), _mm_or_si128(c, a));
+  }
+  return i;
+}
+
+// Packed components form one bit stream once each word is in host order, and
+// no 10 or 12 bit component spans more than two bytes of it. So one pshufb
+// per 8 lanes gathers the two bytes of each component, picking them from
+// where the byte swap would have put them, and a multiply by a power of two
+// per lane then lifts the component to the top of its lane, where one shift
+// brings it down. Each group of 8 lanes is 8 components, or 2 rgba pixels
+// with the alpha lanes left empty, and loads 16 bytes from a word boundary.
+struct DpxPackedTables
+{
+  int groups;                     // groups in a block, which ends on a word boundary
+  int components;                 // components in a block
+  int words;                      // words in a block
+  int reach;                      // words a block's loads read
+  int base[8];                    // first byte each group loads
+  unsigned char order[8][16];
+  short multiply[8][8];
+};
+
+static void DpxPackedSetup(int bits, bool flipEndian, bool addAlpha, int groups, DpxPackedTables& t)
+{
+  const int perGroup = addAlpha ? 6 : 8;
+  t.groups = groups;
+  t.components = groups * perGroup;
+  t.words = t.components * bits / 32;
+  for (int g = 0; g < groups; g++) {
+    const int first = g * perGroup;
+    t.base[g] = (first * bits / 8) & ~3;
+    for (int j = 0; j < 8; j++) {
+      if (addAlpha && (j & 3) == 3) {
+        t.order[g][2 * j] = t.order[g][2 * j + 1] = 0x80;
+        t.multiply[g][j] = 0;
+        continue;
+      }
+      const int c = addAlpha ? first + (j >> 2) * 3 + (j & 3) : first + j;
+      const int bit = c * bits;
+      for (int m = 0; m < 2; m++) {
+        const int byte = bit / 8 + m;
+        t.order[g][2 * j + m] = (unsigned char)((flipEndian ? (byte & ~3) | (3 - (byte & 3)) : byte) - t.base[g]);
+      }
+      t.multiply[g][j] = short(1 << (16 - bits - bit % 8));
+    }
+  }
+  t.reach = (t.base[groups - 1] + 16 + 3) / 4;
+}
+
+__attribute__((target("ssse3"))) static inline __m128i DpxPackedGroup(const char* src, const DpxPackedTables& t, int g, __m128i down, __m128i upDown, bool scale, __m128i alpha)
+{
+  const __m128i order = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.order[g]));
+  const __m128i multiply = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.multiply[g]));
+  const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + t.base[g])), order);
+  __m128i c = _mm_srl_epi16(_mm_mullo_epi16(v, multiply), down);
+  if (scale)
+    c = _mm_or_si128(_mm_sll_epi16(c, down), _mm_srl_epi16(c, upDown));
+  return _mm_or_si128(c, alpha);
+}
+
+__attribute__((target("ssse3"))) static int DpxPackedSSSE3(const U32* src, int words, int bits, bool flipEndian, bool scale, bool addAlpha, U16 alpha, int components, U16* dst)
+{
+  DpxPackedTables t;
+  DpxPackedSetup(bits, flipEndian, addAlpha, addAlpha ? 8 : 2, t);
+  // (v << (16 - bits)) | (v >> (2 * bits - 16)), as SCALE_BITS_TO_DEST_RANGE does
+  const __m128i down = _mm_cvtsi32_si128(16 - bits);
+  const __m128i upDown = _mm_cvtsi32_si128(2 * bits - 16);
+  const __m128i a = addAlpha ? _mm_setr_epi16(0, 0, 0, short(alpha), 0, 0, 0, short(alpha)) : _mm_setzero_si128();
+  int i = 0, w = 0;
+  for (; i + t.components <= components && w + t.reach <= words; i += t.components, w += t.words) {
+    const char* block = reinterpret_cast<const char*>(src + w);
+    for (int g = 0; g < t.groups; g++)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8 * g), DpxPackedGroup(block, t, g, down, upDown, scale, a));
+    dst += 8 * t.groups;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static int DpxPackedAVX2(const U32* src, int words, int bits, bool flipEndian, bool scale, bool addAlpha, U16 alpha, int components, U16* dst)
+{
+  DpxPackedTables t;
+  DpxPackedSetup(bits, flipEndian, addAlpha, addAlpha ? 8 : 4, t);
+  // groups 2h and 2h + 1 share a register, one in each lane
+  __m256i order[4], multiply[4];
+  for (int h = 0; h < t.groups / 2; h++) {
+    order[h] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(t.order[2 * h]));
+    multiply[h] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(t.multiply[2 * h]));
+  }
+  const __m128i down = _mm_cvtsi32_si128(16 - bits);
+  const __m128i upDown = _mm_cvtsi32_si128(2 * bits - 16);
+  const __m256i a = addAlpha ? DpxBothLanes(_mm_setr_epi16(0, 0, 0, short(alpha), 0, 0, 0, short(alpha))) : _mm256_setzero_si256();
+  int i = 0, w = 0;
+  for (; i + t.components <= components && w + t.reach <= words; i += t.components, w += t.words) {
+    const char* block = reinterpret_cast<const char*>(src + w);
+    for (int h = 0; h < t.groups / 2; h++) {
+      const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + t.base[2 * h]));
+      const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + t.base[2 * h + 1]));
+      const __m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), order[h]);
+      __m256i c = _mm256_srl_epi16(_mm256_mullo_epi16(v, multiply[h]), down);
+      if (scale)
+        c = _mm256_or_si256(_mm256_sll_epi16(c, down), _mm256_srl_epi16(c, upDown));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 16 * h), _mm256_or_si256(c, a));
+    }
+    dst += 8 * t.groups;
+  }
+  return i + DpxPackedSSSE3(src + w, words - w, bits, flipEndian, scale, addAlpha, alpha, components - i, dst);
+}
+
+__attribute__((target("avx2"))) static int DpxFilled10AVX2(const U32* src, int words, const int shifts[3], bool flipEndian, bool scale, bool addAlpha, U16 alpha, U16* dst)
+{
+  const __m256i order = DpxBothLanes(DpxWordOrder(flipEndian));
+  const __m256i mask = _mm256_set1_epi32(0x3ff);
+  const __m128i s1 = _mm_cvtsi32_si128(shifts[0]);
+  const __m128i s2 = _mm_cvtsi32_si128(shifts[1]);
+  const __m128i s3 = _mm_cvtsi32_si128(shifts[2]);
+  const __m256i alphaHigh = _mm256_set1_epi32(int(U32(alpha) << 16));
+  int i = 0;
+  for (; i + 8 <= words; i += 8) {
+    const __m256i w = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)), order);
+    __m256i c1 = _mm256_and_si256(_mm256_srl_epi32(w, s1), mask);
+    __m256i c2 = _mm256_and_si256(_mm256_srl_epi32(w, s2), mask);
+    __m256i c3 = _mm256_and_si256(_mm256_srl_epi32(w, s3), mask);
+    if (scale) {
+      c1 = DpxScale10AVX2(c1);
+      c2 = DpxScale10AVX2(c2);
+      c3 = DpxScale10AVX2(c3);
+    }
+    const __m256i rg = _mm256_or_si256(c1, _mm256_slli_epi32(c2, 16));
+    const __m256i ba = _mm256_or_si256(c3, alphaHigh);
+    // words 0, 1 and 4, 5 in p, words 2, 3 and 6, 7 in q
+    const __m256i p = _mm256_unpacklo_epi32(rg, ba);
+    const __m256i q = _mm256_unpackhi_epi32(rg, ba);
+    if (addAlpha) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), _mm256_permute2x128_si256(p, q, 0x20));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 16), _mm256_permute2x128_si256(p, q, 0x31));
+      dst += 32;
+    }
+    else {
+      DpxStoreRgb(dst, _mm256_castsi256_si128(p), _mm256_castsi256_si128(q));
+      DpxStoreRgb(dst + 12, _mm256_extracti128_si256(p, 1), _mm256_extracti128_si256(q, 1));
+      dst += 24;
+    }
+  }
+  return i + DpxFilled10SSSE3(src + i, words - i, shifts, flipEndian, scale, addAlpha, alpha, dst);
+}
+
+__attribute__((target("avx2"))) static int DpxFilled10RevAVX2(const U32* src, int words, const int shifts[3], bool flipEndian, U32 alpha, U32* dst)
+{
+  const __m256i order = DpxBothLanes(DpxWordOrder(flipEndian));
+  const __m256i mask = _mm256_set1_epi32(0x3ff);
+  const __m128i s1 = _mm_cvtsi32_si128(shifts[0]);
+  const __m128i s2 = _mm_cvtsi32_si128(shifts[1]);
+  const __m128i s3 = _mm_cvtsi32_si128(shifts[2]);
+  const __m256i a = _mm256_set1_epi32(int(alpha));
+  int i = 0;
+  for (; i + 8 <= words; i += 8) {
+    const __m256i w = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)), order);
+    __m256i out = _mm256_or_si256(_mm256_and_si256(_mm256_srl_epi32(w, s1), mask), a);
+    out = _mm256_or_si256(out, _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(w, s2), mask), 10));
+    out = _mm256_or_si256(out, _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(w, s3), mask), 20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), out);
+  }
+  return i + DpxFilled10RevSSSE3(src + i, words - i, shifts, flipEndian, alpha, dst + i);
+}
+
+__attribute__((target("avx2"))) static int DpxFilled12AVX2(const U16* src, int components, int shift, bool flipEndian, bool scale, U16* dst)
+{
+  const __m256i order = DpxBothLanes(DpxHalfWordOrder(flipEndian));
+  const __m256i mask = _mm256_set1_epi16(0xfff);
+  const __m128i s = _mm_cvtsi32_si128(shift);
+  int i = 0;
+  for (; i + 16 <= components; i += 16) {
+    const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)), order);
+    __m256i c = _mm256_and_si256(_mm256_srl_epi16(v, s), mask);
+    if (scale)
+      c = DpxScale12AVX2(c);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), c);
+  }
+  return i + DpxFilled12SSSE3(src + i, components - i, shift, flipEndian, scale, dst + i);
+}
+
+__attribute__((target("avx2"))) static int DpxFilled12RgbaAVX2(const U16* src, int pixels, int shift, bool flipEndian, bool scale, U16 alpha, U16* dst)
+{
+  const __m256i order = DpxBothLanes(DpxRgbToRgbaOrder(flipEndian));
+  const __m256i mask = _mm256_set1_epi16(0xfff);
+  const __m128i s = _mm_cvtsi32_si128(shift);
+  const __m256i a = DpxBothLanes(_mm_setr_epi16(0, 0, 0, short(alpha), 0, 0, 0, short(alpha)));
+  int i = 0;
+  // pixels i, i + 1 in the low lane and i + 2, i + 3 in the high one, each
+  // 16 byte load reaching into the next pixel
+  for (; i + 5 <= pixels; i += 4) {
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i + 6));
+    const __m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), order);
+    __m256i c = _mm256_and_si256(_mm256_srl_epi16(v, s), mask);
+    if (scale)
+      c = DpxScale12AVX2(c);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4 * i), _mm256_or_si256(c, a));
+  }
+  return i + DpxFilled12RgbaSSSE3(src + 3 * i, pixels - i, shift, flipEndian, scale, alpha, dst + 4 * i);
+}
+#endif
+
+static const DpxUnpackers& SelectDpxUnpackers()
+{
+  static const DpxUnpackers none = { "scalar", DpxFilled10None, DpxFilled10RevNone, DpxFilled12None, DpxFilled12RgbaNone, DpxPackedNone };
+#ifdef DPX_WIDE_SIMD
+  static const DpxUnpackers ssse3 = { "ssse3", DpxFilled10SSSE3, DpxFilled10RevSSSE3, DpxFilled12SSSE3, DpxFilled12RgbaSSSE3, DpxPackedSSSE3 };
+  static const DpxUnpackers avx2 = { "avx2", DpxFilled10AVX2, DpxFilled10RevAVX2, DpxFilled12AVX2, DpxFilled12RgbaAVX2, DpxPackedAVX2 };
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return ssse3;
+#endif
+  return none;
+}
+
+#endif
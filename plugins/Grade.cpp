@@ -14,13 +14,158 @@ const char* const HELP =
 #include "DDImage/Row.h"
 #include "DDImage/DDMath.h"
 #include "DDImage/NukeWrapper.h"
+#include <stdint.h>
 #include <string.h>
 #include <algorithm>
+#include <vector>
+
+#include "HalfFloat.h"
 
 using namespace DD::Image;
 
 static const char* const CLASS = "Grade";
 
+enum { GAMMA_NONE, GAMMA_POWER, GAMMA_STEP, GAMMA_LUT };
+
+/*! If v is exactly a finite half float, store its bit pattern in half and
+   return true. Values that would need rounding return false.
+ */
+static inline bool exactHalf(float v, unsigned& half)
+{
+  uint32_t f;
+  memcpy(&f, &v, sizeof(f));
+  const uint32_t sign = (f >> 16) & 0x8000;
+  const int exponent = int((f >> 23) & 0xff) - 127;
+  const uint32_t mantissa = f & 0x7fffff;
+
+  if (exponent >= -14 && exponent <= 15) {
+    if (mantissa & 0x1fff)
+      return false;
+    half = sign | ((exponent + 15) << 10) | (mantissa >> 13);
+    return true;
+  }
+  if (exponent >= -24 && exponent < -14) {
+    // a half denormal, a multiple of 2^-24
+    const uint32_t full = mantissa | 0x800000;
+    const int shift = -1 - exponent;
+    if (full & ((1u << shift) - 1))
+      return false;
+    half = sign | (full >> shift);
+    return true;
+  }
+  if (!(f & 0x7fffffff)) {
+    half = sign;
+    return true;
+  }
+  return false;
+}
+
+struct GradeChannel;
+
+// Grades one channel of a row, in may be the same as out.
+typedef void (*GradeLineFn)(const float* in, float* out, int w, const GradeChannel& c);
+
+// Everything pixel_engine needs for one of the four colour channels, worked
+// out in _validate.
+struct GradeChannel
+{
+  float A, B;      // linear part, already inverted when reversing
+  float G;         // gamma exponent: 1/gamma forward, gamma in reverse
+  float zeroB;     // B of the forward grade, a zero input stays zero if this is 0
+  const float* lut; // GAMMA_LUT: the gamma of every half float bit pattern
+  GradeLineFn line;
+};
+
+/*! The gamma stage for GAMMA_LUT. Values that are exactly a half float, as
+   they are when read from half float files and not scaled, are looked up.
+   The rest of 0..1 uses powf().
+ */
+template<bool Reverse>
+static inline float lutGamma(float v, float G, const float* lut)
+{
+  unsigned half;
+  if (exactHalf(v, half))
+    return lut[half];
+  if (Reverse ? v <= 0.0f : v < 0.0f)
+    return v;
+  if (v < 1.0f)
+    return powf(v, G);
+  return 1.0f + (v - 1.0f) * G;
+}
+
+/*! The whole grade of one channel in a single pass over the row, so each
+   pixel is read and written once while it is in cache. Every combination
+   of the knobs that changes the code is its own instantiation, picked in
+   _validate, so the loop has no branches on them.
+ */
+template<bool Reverse, bool BlackClamp, bool WhiteClamp, int GammaMode>
+static void gradeLine(const float* in, float* out, int w, const GradeChannel& c)
+{
+  const float A = c.A;
+  const float B = c.B;
+  const float G = c.G;
+  for (int i = 0; i < w; i++) {
+    float v = in[i];
+    if (!Reverse) {
+      v = v * A + B;
+      if (BlackClamp && WhiteClamp)
+        v = std::max(std::min(v, 1.0f), 0.0f);
+      else if (BlackClamp)
+        v = std::max(v, 0.0f);
+      else if (WhiteClamp)
+        v = std::min(v, 1.0f);
+      if (GammaMode == GAMMA_STEP)
+        v = v < 0.0f ? 0.0f : v > 1.0f ? INFINITY : v;
+      else if (GammaMode == GAMMA_POWER)
+        v = v < 0.0f ? v : v < 1.0f ? powf(v, G) : 1.0f + (v - 1.0f) * G;
+      else if (GammaMode == GAMMA_LUT)
+        v = lutGamma<false>(v, G, c.lut);
+    }
+    else {
+      if (GammaMode == GAMMA_STEP)
+        v = v > 0.0f ? 1.0f : 0.0f;
+      else if (GammaMode == GAMMA_POWER)
+        v = v <= 0.0f ? v : v < 1.0f ? powf(v, G) : 1.0f + (v - 1.0f) * G;
+      else if (GammaMode == GAMMA_LUT)
+        v = lutGamma<true>(v, G, c.lut);
+      v = v * A + B;
+      // reversing with both clamps on only clamps black
+      if (BlackClamp)
+        v = std::max(v, 0.0f);
+      else if (WhiteClamp)
+        v = std::min(v, 1.0f);
+    }
+    out[i] = v;
+  }
+}
+
+template<bool Reverse, bool BlackClamp, bool WhiteClamp>
+static GradeLineFn gradeLineFor(int gammaMode)
+{
+  switch (gammaMode) {
+    case GAMMA_POWER:
+      return gradeLine<Reverse, BlackClamp, WhiteClamp, GAMMA_POWER>;
+    case GAMMA_STEP:
+      return gradeLine<Reverse, BlackClamp, WhiteClamp, GAMMA_STEP>;
+    case GAMMA_LUT:
+      return gradeLine<Reverse, BlackClamp, WhiteClamp, GAMMA_LUT>;
+    default:
+      return gradeLine<Reverse, BlackClamp, WhiteClamp, GAMMA_NONE>;
+  }
+}
+
+static GradeLineFn selectGradeLine(bool reverse, bool blackClamp, bool whiteClamp, int gammaMode)
+{
+  if (reverse) {
+    if (blackClamp)
+      return whiteClamp ? gradeLineFor<true, true, true>(gammaMode) : gradeLineFor<true, true, false>(gammaMode);
+    return whiteClamp ? gradeLineFor<true, false, true>(gammaMode) : gradeLineFor<true, false, false>(gammaMode);
+  }
+  if (blackClamp)
+    return whiteClamp ? gradeLineFor<false, true, true>(gammaMode) : gradeLineFor<false, true, false>(gammaMode);
+  return whiteClamp ? gradeLineFor<false, false, true>(gammaMode) : gradeLineFor<false, false, false>(gammaMode);
+}
+
 class GradeIop : public PixelIop
 {
   float blackpoint[4];
@@ -33,6 +178,18 @@ class GradeIop : public PixelIop
   bool reverse;
   bool black_clamp;
   bool white_clamp;
+
+  bool half_lut;
+
+  GradeChannel _channels[4];
+
+  // Gamma tables for half_lut, and the exponent and direction each was
+  // built for so they are only rebuilt when those change.
+  std::vector<float> _lut[4];
+  float _lutG[4];
+  bool _lutReverse[4];
+
+  void buildLut(int z, float G);
   
   // String used to store the fragment shader source code generated and returned by gpuEngine_body().
   // Needs to be mutable since gpuEngine_body() is (quite reasonably) const.
@@ -49,6 +206,11 @@ public:
     reverse = false;
     black_clamp = true;
     white_clamp = false;
+    half_lut = false;
+    for (int n = 0; n < 4; n++) {
+      _lutG[n] = 0.0f;
+      _lutReverse[n] = false;
+    }
   }
   // indicate that channels only depend on themselves:
   void in_channels(int, ChannelSet& channels) const override { }
@@ -102,6 +264,29 @@ void GradeIop::_validate(bool for_real)
       if (B)
         change_zero = true;
     }
+
+    GradeChannel& c = _channels[z];
+    c.zeroB = B;
+    if (reverse) {
+      if (A != 1.0f || B) {
+        A = A ? 1 / A : 1.0f;
+        B = -B * A;
+      }
+      c.G = gamma[z];
+    }
+    else {
+      c.G = gamma[z] > 0 ? 1.0f / gamma[z] : 1.0f;
+    }
+    c.A = A;
+    c.B = B;
+    int gammaMode = gamma[z] <= 0 ? GAMMA_STEP : gamma[z] != 1.0f ? GAMMA_POWER : GAMMA_NONE;
+    c.lut = nullptr;
+    if (gammaMode == GAMMA_POWER && half_lut) {
+      buildLut(z, c.G);
+      c.lut = &_lut[z][0];
+      gammaMode = GAMMA_LUT;
+    }
+    c.line = selectGradeLine(reverse, black_clamp, white_clamp, gammaMode);
   }
   set_out_channels(change_any ? Mask_All : Mask_None);
   PixelIop::_validate(for_real);
@@ -109,124 +294,45 @@ void GradeIop::_validate(bool for_real)
     info_.black_outside(false);
 }
 
+/*! Fill _lut[z] with the gamma stage, exponent G, applied to every half
+   float bit pattern, using the same powf as the GAMMA_POWER loop so looked
+   up values are identical to it.
+ */
+void GradeIop::buildLut(int z, float G)
+{
+  if (_lut[z].size() == 65536 && _lutG[z] == G && _lutReverse[z] == reverse)
+    return;
+  _lut[z].resize(65536);
+  for (unsigned half = 0; half < 65536; half++) {
+    const float v = halfToFloat(half);
+    float out;
+    if (reverse ? v <= 0.0f : v < 0.0f)
+      out = v;
+    else if (v < 1.0f)
+      out = powf(v, G);
+    else
+      out = 1.0f + (v - 1.0f) * G;
+    _lut[z][half] = out;
+  }
+  _lutG[z] = G;
+  _lutReverse[z] = reverse;
+}
+
 void GradeIop::pixel_engine(const Row& in, int y, int x, int r,
                             ChannelMask channels, Row& out)
 {
-  auto clampBlack = [](const float x) { return std::max(x, 0.0f); };
-  auto clampWhite = [](const float x) { return std::min(x, 1.0f); };
-  auto clampBoth =  [](const float x) { return std::max(std::min(x, 1.0f), 0.0f); };
-  const int w = r-x;
-
   for (Channel n : channels) {
     unsigned z = colourIndex(n);
     if (z > 3) {
       out.copy(in, n, x, r);
       continue;
     }
-    float A = whitepoint[z] - blackpoint[z];
-    A = A ? (white[z] - black[z]) / A : 10000.0f;
-    A *= multiply[z];
-    float B = add[z] + black[z] - blackpoint[z] * A;
-    if (!B && in.is_zero(n)) {
+    const GradeChannel& c = _channels[z];
+    if (!c.zeroB && in.is_zero(n)) {
       out.erase(n);
       continue;
     }
-    float G = gamma[z];
-    const float* inBegin = in[n] + x;
-    float* outptr = out.writable(n) + x;
-    if (!reverse) {
-      // do the linear interpolation:
-      if (A != 1 || B) {
-        std::transform(inBegin, inBegin+w, outptr, [A, B](const float x) { return x*A+B; });
-        inBegin = outptr;
-      }
-      // clamp
-      if (white_clamp || black_clamp) {
-        if (!white_clamp) {
-          std::transform(inBegin, inBegin+w, outptr, clampBlack);
-        }
-        else if (!black_clamp) {
-          std::transform(inBegin, inBegin+w, outptr, clampWhite);
-        }
-        else {
-          std::transform(inBegin, inBegin+w, outptr, clampBoth);
-        }
-        inBegin = outptr;
-      }
-      // do the gamma:
-      if (G <= 0) {
-        std::transform(inBegin, inBegin+w, outptr,
-          [](const float x) {
-            if (x < 0.0f)
-              return 0.0f;
-            if (x > 1.0f)
-              return INFINITY;
-            return x;
-          }
-        );
-      }
-      else if (G != 1.0f) {
-        G = 1.0f / G;
-        std::transform(inBegin, inBegin+w, outptr,
-          [G](const float x) {
-            if (x < 0.0f)
-              return x;
-            if (x < 1.0f)
-              return powf(x, G);
-            return 1.0f + (x - 1.0f) * G;
-          }
-        );
-      }
-      else if (inBegin != outptr) {
-        std::copy(inBegin, inBegin+w, outptr);
-      }
-    }
-    else {
-      // Reverse gamma:
-      if (G <= 0) {
-        std::transform(inBegin, inBegin+w, outptr,
-          [](const float x) {
-            return x > 0.0f ? 1.0f : 0.0f;
-          }
-        );
-        inBegin = outptr;
-      }
-      else if (G != 1.0f) {
-        std::transform(inBegin, inBegin+w, outptr,
-          [G](const float x) {
-            if (x <= 0.0f)
-              return x;              //V = 0.0f;
-            else if (x < 1.0f)
-              return powf(x, G);
-            return 1.0f + (x - 1.0f) * G;
-          }
-        );
-        inBegin = outptr;
-      }
-      // Reverse the linear part:
-      if (A != 1.0f || B) {
-        if (A)
-          A = 1 / A;
-        else
-          A = 1.0f;
-        B = -B * A;
-        std::transform(inBegin, inBegin+w, outptr, [A, B](const float x) { return x*A+B; });
-        inBegin = outptr;
-      }
-      // clamp
-      if (white_clamp || black_clamp) {
-        if (black_clamp) {
-          std::transform(inBegin, inBegin+w, outptr, clampBlack);
-        }
-        else if (white_clamp) {
-          std::transform(inBegin, inBegin+w, outptr, clampWhite);
-        }
-        inBegin = outptr;
-      }
-      else if (inBegin != outptr) {
-        std::copy(inBegin, inBegin+w, outptr);
-      }
-    }
+    c.line(in[n] + x, out.writable(n) + x, r - x, c);
   }
 }
 
@@ -255,6 +361,13 @@ void GradeIop::knobs(Knob_Callback f)
   Tooltip(f, "Output that is less than zero is changed to zero");
   Bool_knob(f, &white_clamp, "white_clamp", "white clamp");
   Tooltip(f, "Output that is greater than 1 is changed to 1");
+  Bool_knob(f, &half_lut, "half_lut", "half LUT gamma");
+  SetFlags(f, Knob::STARTLINE);
+  Tooltip(f, "Look the gamma up in a table of every half float value instead "
+             "of calling pow. Values that are exactly half floats, such as "
+             "half float plates with no linear change before the gamma, give "
+             "the same result. Other values still call pow, so this only helps "
+             "when most of the input is unscaled half float.");
 }
 
 const char* GradeIop::gpuEngine_decl() const
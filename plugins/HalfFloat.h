@@ -0,0 +1,83 @@
+// Copyright (c) 2018 The Foundry Visionmongers Ltd.  All Rights Reserved.
+
+// HalfFloat.h
+
+// Conversions between float and the 16 bit half float bit pattern, shared
+// by the plugins that store or look up half floats.
+
+#ifndef HALFFLOAT_H
+#define HALFFLOAT_H
+
+#include <string.h>
+
+/* Convert to half float, rounding to nearest even. */
+static inline unsigned short floatToHalf(float value)
+{
+  unsigned int f;
+  memcpy(&f, &value, sizeof(f));
+
+  const unsigned int sign = (f >> 16) & 0x8000;
+  const int exponent = int((f >> 23) & 0xff) - 127 + 15;
+  unsigned int mantissa = f & 0x7fffff;
+
+  if (((f >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);   // inf or nan
+  if (exponent >= 31)
+    return sign | 0x7c00;                            // overflow to inf
+
+  if (exponent <= 0) {
+    // denormal, or too small and flushed to zero
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    unsigned int half = mantissa >> shift;
+    const unsigned int rest = mantissa & ((1u << shift) - 1);
+    const unsigned int halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1)))
+      half++;
+    return sign | half;
+  }
+
+  // a carry out of the mantissa correctly bumps the exponent
+  unsigned int half = (exponent << 10) | (mantissa >> 13);
+  const unsigned int rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    half++;
+  return sign | half;
+}
+
+static inline float halfToFloat(unsigned short half)
+{
+  const unsigned int sign = (half & 0x8000) << 16;
+  unsigned int exponent = (half >> 10) & 0x1f;
+  unsigned int mantissa = half & 0x3ff;
+  unsigned int f;
+
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      f = sign;
+    }
+    else {
+      // renormalise the denormal
+      exponent = 127 - 14;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  }
+  else if (exponent == 31) {
+    f = sign | 0x7f800000 | (mantissa << 13);
+  }
+  else {
+    f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  memcpy(&value, &f, sizeof(value));
+  return value;
+}
+
+#endif
@@ -17,6 +17,13 @@
 // Standard plug-in include files.
 
 #include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+#ifndef FN_PROCESSOR_PPC
+  #include <xmmintrin.h>
+#endif
 #include "DDImage/Iop.h"
 #include "DDImage/NukeWrapper.h"
 #include "DDImage/Row.h"
@@ -53,6 +60,34 @@ static const char* const HELP =
   "U and V value of -1, 5, the pixel's value will come "
   "from 50,28 of the input channels.";
 
+// Samples whose du and dv are within this of the unit vectors are not
+// minified, so the filter reduces to separable weights around the center:
+static const float kUnitFootprint = 0.05f;
+
+// The fast path locks the input around its samples in one tile, unless
+// that would be larger than this many pixels:
+static const int kMaxUnitTile = 1 << 22;
+
+static inline bool isUnitFootprint(const Vector2& du, const Vector2& dv)
+{
+  return fabsf(du.x - 1) < kUnitFootprint && fabsf(du.y) < kUnitFootprint &&
+         fabsf(dv.x) < kUnitFootprint && fabsf(dv.y - 1) < kUnitFootprint;
+}
+
+// The input area locked up front for the area sampler is capped at this
+// many pixels, above it the sampler locks lines as it goes instead:
+static const int kMaxSampleArea = 1 << 22;
+
+// A unit footprint sample: the output pixel, the input pixels the filter
+// covers in each direction, and where its normalised weights start.
+struct UnitSample
+{
+  int x;
+  int firstX, countX;
+  int firstY, countY;
+  size_t weights; // countX x weights, then countY y weights
+};
+
 // Definition of the new operator class.
 
 class IDistort : public MultiTileIop
@@ -65,6 +100,7 @@ class IDistort : public MultiTileIop
   Channel alpha_channel;
   bool invert_alpha;
   bool premultiplied;
+  bool fast_unit;
   Filter filter;
 
 public:
@@ -79,6 +115,7 @@ public:
     alpha_channel = Chan_Black;
     invert_alpha = false;
     premultiplied = false;
+    fast_unit = true;
   }
 
   ~IDistort () override { }
@@ -113,6 +150,8 @@ public:
   Iop* inputToRead() const override;
 
   template<class TileType> inline void doEngine(int y, int x, int r, ChannelMask channels, Row& row);
+  template<class TileType> inline bool sampleUnit(const std::vector<UnitSample>& samples, const std::vector<float>& weights,
+                                                  const Box& area, ChannelMask channels, Row& out);
 
   mFnDDImageMultiTileIop_DeclareFunctions_engine(int y, int x, int r, ChannelMask m, Row& row);
 
@@ -143,6 +182,11 @@ public:
     Tooltip(f, "Check this if the uv and blur channels have been premultiplied"
                " by the alpha channel, such as when output by a renderer.");
     filter.knobs(f);
+    Bool_knob(f, &fast_unit, "fast_unit", "fast unit samples");
+    Tooltip(f, "Pixels whose distortion does not scale or rotate the input "
+               "are filtered directly from the input instead of through "
+               "the area sampler, which is much faster for the near "
+               "identity parts of a distortion.");
   }
 
   const char* Class() const override { return CLASS; }
@@ -221,13 +265,96 @@ template<class TileType> void IDistort::doEngine ( int y, int x, int r, ChannelM
   const float blur_yscale = float(this->blur_yscale);
 
   foreach(z, channels) out.writable(z);
-  InterestRatchet interestRatchet;
   Pixel pixel(channels);
-  pixel.setInterestRatchet(&interestRatchet);
 
   std::vector<SamplePosition> samplePositions;
   samplePositions.reserve(r - x + 1);
 
+  // Samples with a unit footprint are filtered directly from the input by
+  // sampleUnit(), everything else goes through the area sampler:
+  std::vector<UnitSample> unitSamples;
+  std::vector<float> unitWeights;
+  Box unitArea;
+  const Box inputBox = input0().info();
+  const bool fastUnit = fast_unit && inputBox.w() > 0 && inputBox.h() > 0;
+
+  // How far the filter reaches from a sample, in footprints. The filter
+  // stretches with the footprint once it is wider than a pixel.
+  Filter::Coefficients reachCoefficients;
+  filter.get(0.5f, 1, reachCoefficients);
+  const float filterReach = std::max(0.5f - reachCoefficients.first,
+                                     reachCoefficients.first + reachCoefficients.count - 0.5f);
+
+  // The union of the footprints sent to the area sampler, so the input
+  // under them can be locked once instead of sample by sample. Samples
+  // with infinite or NaN positions or footprints cannot be bounded, so
+  // they go to ratchetSamples for the sampler that locks as it goes.
+  std::vector<SamplePosition> ratchetSamples;
+  float areaX = INFINITY, areaY = INFINITY, areaR = -INFINITY, areaT = -INFINITY;
+  auto growSampleArea = [&](const Vector2& center, const Vector2& du, const Vector2& dv) {
+    const float ex = filterReach * std::max(1.0f, fabsf(du.x) + fabsf(dv.x)) + 1;
+    const float ey = filterReach * std::max(1.0f, fabsf(du.y) + fabsf(dv.y)) + 1;
+    if (!std::isfinite(center.x) || !std::isfinite(center.y) || !std::isfinite(ex) || !std::isfinite(ey))
+      return false;
+    areaX = std::min(areaX, center.x - ex);
+    areaY = std::min(areaY, center.y - ey);
+    areaR = std::max(areaR, center.x + ex);
+    areaT = std::max(areaT, center.y + ey);
+    return true;
+  };
+  auto addAreaSample = [&](const Vector2& center, const Vector2& du, const Vector2& dv, int outX) {
+    if (growSampleArea(center, du, dv))
+      samplePositions.emplace_back(center, du, dv, outX);
+    else
+      ratchetSamples.emplace_back(center, du, dv, outX);
+  };
+
+  auto addSample = [&](const Vector2& center, const Vector2& du, const Vector2& dv, int outX) {
+    if (!fastUnit || !isUnitFootprint(du, dv) || !std::isfinite(center.x) || !std::isfinite(center.y)) {
+      addAreaSample(center, du, dv, outX);
+      return;
+    }
+    Filter::Coefficients cx, cy;
+    filter.get(center.x, 1, cx);
+    filter.get(center.y, 1, cy);
+    if (cx.count <= 0 || cy.count <= 0) {
+      addAreaSample(center, du, dv, outX);
+      return;
+    }
+
+    // grow the locked area by the input pixels used, clamped to the input
+    // as the edges repeat outside it
+    const int ux = std::min(std::max(cx.first, inputBox.x()), inputBox.r() - 1);
+    const int ur = std::min(std::max(cx.first + cx.count, inputBox.x() + 1), inputBox.r());
+    const int uy = std::min(std::max(cy.first, inputBox.y()), inputBox.t() - 1);
+    const int ut = std::min(std::max(cy.first + cy.count, inputBox.y() + 1), inputBox.t());
+    Box area(ux, uy, ur, ut);
+    if (!unitSamples.empty())
+      area.merge(unitArea);
+    if (size_t(area.w()) * size_t(area.h()) > size_t(kMaxUnitTile)) {
+      addAreaSample(center, du, dv, outX);
+      return;
+    }
+    unitArea = area;
+
+    UnitSample sample;
+    sample.x = outX;
+    sample.firstX = cx.first;
+    sample.countX = cx.count;
+    sample.firstY = cy.first;
+    sample.countY = cy.count;
+    sample.weights = unitWeights.size();
+    for (const Filter::Coefficients* c : { &cx, &cy }) {
+      float sum = 0;
+      for (int i = 0; i < c->count; i++)
+        sum += c->array[i * c->delta];
+      const float scale = sum ? 1 / sum : 1;
+      for (int i = 0; i < c->count; i++)
+        unitWeights.push_back(c->array[i * c->delta] * scale);
+    }
+    unitSamples.push_back(sample);
+  };
+
   if (alpha && this->premultiplied) {
     for (; x < r; x++) {
       if (aborted()) {
@@ -244,7 +371,7 @@ template<class TileType> void IDistort::doEngine ( int y, int x, int r, ChannelM
         // this will introduce distortion in the black areas so that the
         // user can tell if they incorrectly turned on premultiplied:
 
-        samplePositions.emplace_back(U0[x] * u_scale + x + .5f, V0[x] * v_scale + y + .5f, 1, 1, x);
+        addSample(Vector2(U0[x] * u_scale + x + .5f, V0[x] * v_scale + y + .5f), Vector2(1, 0), Vector2(0, 1), x);
 
         continue;
       }
@@ -271,7 +398,7 @@ template<class TileType> void IDistort::doEngine ( int y, int x, int r, ChannelM
         dv.y = fabsf(dv.y) + blur[x] * blur_yscale;
       }
 
-      samplePositions.emplace_back(center, du, dv, x);
+      addSample(center, du, dv, x);
     }
   }
   else if ( alpha ) {
@@ -290,7 +417,7 @@ template<class TileType> void IDistort::doEngine ( int y, int x, int r, ChannelM
         // If the alpha is zero (or less) simply copy the color without
         // using any offset.
 
-        samplePositions.emplace_back(x + .5f, y + .5f, 1, 1, x);
+        addSample(Vector2(x + .5f, y + .5f), Vector2(1, 0), Vector2(0, 1), x);
 
         continue;
       }
@@ -318,7 +445,7 @@ template<class TileType> void IDistort::doEngine ( int y, int x, int r, ChannelM
         dv.y = fabsf(dv.y) + blur[x] * blur_yscale * a;
       }
 
-      samplePositions.emplace_back(center, du, dv, x);
+      addSample(center, du, dv, x);
     }
   }
   else {
@@ -374,14 +501,53 @@ template<class TileType> void IDistort::doEngine ( int y, int x, int r, ChannelM
         dv.y = fabsf(dv.y) + blur[x] * blur_yscale;
       }
 
-      samplePositions.emplace_back(center, du, dv, x);
+      addSample(center, du, dv, x);
+    }
+  }
+
+  if (!unitSamples.empty() && !sampleUnit<TileType>(unitSamples, unitWeights, unitArea, channels, out))
+    return;
+
+  if (!samplePositions.empty()) {
+    // Lock the input under all the footprints as one Interest and sample
+    // it directly.
+    const float inX = float(inputBox.x()), inR = float(inputBox.r());
+    const float inY = float(inputBox.y()), inT = float(inputBox.t());
+    const float lockX = std::max(floorf(areaX), inX), lockR = std::min(ceilf(areaR), inR);
+    const float lockY = std::max(floorf(areaY), inY), lockT = std::min(ceilf(areaT), inT);
+    if (lockR > lockX && lockT > lockY &&
+        double(lockR - lockX) * double(lockT - lockY) <= double(kMaxSampleArea)) {
+      const Box lockBox(static_cast<int>(lockX), static_cast<int>(lockY), static_cast<int>(lockR), static_cast<int>(lockT));
+      Interest interest(input0(), lockBox, channels);
+      interest.fetch();
+      if (aborted()) {
+        return;
+      }
+
+      Sampler sampler(&input0(), lockBox, channels, &filter, Sampler::eEdgeFromIop, nullptr, false);
+      for (auto& samplePosition : samplePositions) {
+        sampler.sample(samplePosition, pixel);
+        for (auto z: channels) {
+          ((float*)(out[z]))[samplePosition.x] = pixel[z];
+        }
+      }
+    }
+    else {
+      ratchetSamples.insert(ratchetSamples.end(), samplePositions.begin(), samplePositions.end());
     }
   }
 
-  // Create a sampler for the entire requested region since we will be using on demand loading
+  if (ratchetSamples.empty())
+    return;
+
+  // The footprints are too large to lock at once, or cannot be bounded, so
+  // let the sampler ratchet its interest up sample by sample over the whole
+  // requested region
+  InterestRatchet interestRatchet;
+  pixel.setInterestRatchet(&interestRatchet);
   Sampler sampler(&input0(), input0().requestedBox(), channels, &filter, Sampler::eEdgeFromIop, &interestRatchet, true);
 
-  for (auto& samplePosition : samplePositions) {
+  for (auto& samplePosition : ratchetSamples) {
     sampler.sample(samplePosition, pixel);
     for (auto z: channels) {
       ((float*)(out[z]))[samplePosition.x] = pixel[z];
@@ -389,4 +555,90 @@ template<class TileType> void IDistort::doEngine ( int y, int x, int r, ChannelM
   }
 }
 
+/*! The filtered value of unit footprint sample \a s of channel \a z, whose
+   columns all lie inside \a area. Tiles whose rows are plain floats are
+   summed four columns at a time, keeping one vector of partial sums over
+   all the rows of the footprint; other tiles index their rows one pixel
+   at a time.
+ */
+template<class TileType> static inline float unitSum(TileType& tile, Channel z, const UnitSample& s,
+                                                     const float* wx, const float* wy, const Box& area)
+{
+#ifndef FN_PROCESSOR_PPC
+  if constexpr (std::is_convertible<typename TileType::RowPtr, const float*>::value) {
+    const int blocks = s.countX & ~3;
+    __m128 acc = _mm_setzero_ps();
+    float tail = 0;
+    for (int j = 0; j < s.countY; j++) {
+      const int Y = std::min(std::max(s.firstY + j, area.y()), area.t() - 1);
+      const float* row = static_cast<const float*>(tile[z][Y]) + s.firstX;
+      const __m128 w = _mm_set1_ps(wy[j]);
+      for (int i = 0; i < blocks; i += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(w, _mm_mul_ps(_mm_loadu_ps(wx + i), _mm_loadu_ps(row + i))));
+      float rowTail = 0;
+      for (int i = blocks; i < s.countX; i++)
+        rowTail += wx[i] * row[i];
+      tail += wy[j] * rowTail;
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc) + tail;
+  }
+  else
+#endif
+  {
+    float sum = 0;
+    for (int j = 0; j < s.countY; j++) {
+      const int Y = std::min(std::max(s.firstY + j, area.y()), area.t() - 1);
+      const typename TileType::RowPtr row = tile[z][Y];
+      float rowSum = 0;
+      for (int i = 0; i < s.countX; i++)
+        rowSum += wx[i] * row[s.firstX + i];
+      sum += wy[j] * rowSum;
+    }
+    return sum;
+  }
+}
+
+/*! Filter the unit footprint samples straight from the input. Their
+   weights are separable, so each is a weighted sum of input rows, all
+   read from one tile locked over \a area. Returns false if aborted.
+ */
+template<class TileType> bool IDistort::sampleUnit(const std::vector<UnitSample>& samples, const std::vector<float>& weights,
+                                                   const Box& area, ChannelMask channels, Row& out)
+{
+  TileType tile(input0(), area.x(), area.y(), area.r(), area.t(), channels);
+  if (aborted()) {
+    return false;
+  }
+
+  foreach(z, channels) {
+    float* OUT = out.writable(z);
+    if (!intersect(tile.channels(), z)) {
+      for (const UnitSample& s : samples)
+        OUT[s.x] = 0;
+      continue;
+    }
+    for (const UnitSample& s : samples) {
+      const float* wx = &weights[s.weights];
+      const float* wy = wx + s.countX;
+      if (s.firstX >= area.x() && s.firstX + s.countX <= area.r()) {
+        OUT[s.x] = unitSum(tile, z, s, wx, wy, area);
+        continue;
+      }
+      float sum = 0;
+      for (int j = 0; j < s.countY; j++) {
+        const int Y = std::min(std::max(s.firstY + j, area.y()), area.t() - 1);
+        const typename TileType::RowPtr row = tile[z][Y];
+        float rowSum = 0;
+        for (int i = 0; i < s.countX; i++)
+          rowSum += wx[i] * row[std::min(std::max(s.firstX + i, area.x()), area.r() - 1)];
+        sum += wy[j] * rowSum;
+      }
+      OUT[s.x] = sum;
+    }
+  }
+  return true;
+}
+
 mFnDDImageMultiTileIop_DefineFunctions_engine(IDistort)
@@ -0,0 +1,188 @@
+// Copyright (c) 2009 The Foundry Visionmongers Ltd.  All Rights Reserved.
+
+// ImageStats.h
+
+// Parallel reduction of an area of an Iop to its minimum, maximum, sum and
+// sample count, with an optional histogram. It is used by Normalise and
+// NormaliseExecute, and is meant for any op that has to analyse its whole
+// input before it can produce a pixel.
+//
+// The area is cut into bands of rows. Thread::numThreads - 1 helper threads
+// are spawned and, together with the calling thread, take bands off a shared
+// counter. Each band accumulates into its own Stats, so there is no locking
+// while scanning, and the bands are merged in order at the end so the sum
+// does not depend on which thread did which band.
+
+#ifndef IMAGESTATS_H
+#define IMAGESTATS_H
+
+#include "DDImage/Iop.h"
+#include "DDImage/Row.h"
+#include "DDImage/Thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <vector>
+
+namespace ImageStats {
+
+using namespace DD::Image;
+
+struct Stats
+{
+  float minValue;
+  float maxValue;
+  double sum;
+  size_t count;
+
+  // Empty unless bins were asked for. Samples below lo land in the first bin
+  // and samples at or above hi in the last, NaNs are not binned.
+  std::vector<size_t> histogram;
+  float lo, hi;
+
+  Stats(int bins = 0, float lo_ = 0.0f, float hi_ = 1.0f)
+    : minValue(std::numeric_limits<float>::infinity())
+    , maxValue(-std::numeric_limits<float>::infinity())
+    , sum(0.0)
+    , count(0)
+    , histogram(bins, 0)
+    , lo(lo_)
+    , hi(hi_)
+  {}
+
+  double mean() const { return count ? sum / double(count) : 0.0; }
+
+  void add(const float* CUR, const float* END)
+  {
+    float mn = minValue;
+    float mx = maxValue;
+    double s = 0.0;
+    count += END - CUR;
+    if (histogram.empty()) {
+      for (; CUR < END; CUR++) {
+        const float v = *CUR;
+        mn = std::min(v, mn);
+        mx = std::max(v, mx);
+        s += v;
+      }
+    }
+    else {
+      const int last = int(histogram.size()) - 1;
+      const float scale = hi > lo ? float(histogram.size()) / (hi - lo) : 0.0f;
+      for (; CUR < END; CUR++) {
+        const float v = *CUR;
+        mn = std::min(v, mn);
+        mx = std::max(v, mx);
+        s += v;
+        if (v != v)
+          continue;
+        const float f = (v - lo) * scale;
+        const int bin = f <= 0.0f ? 0 : f >= float(last) ? last : int(f);
+        histogram[bin]++;
+      }
+    }
+    minValue = mn;
+    maxValue = mx;
+    sum += s;
+  }
+
+  void merge(const Stats& other)
+  {
+    minValue = std::min(minValue, other.minValue);
+    maxValue = std::max(maxValue, other.maxValue);
+    sum += other.sum;
+    count += other.count;
+    for (size_t i = 0; i < histogram.size() && i < other.histogram.size(); i++)
+      histogram[i] += other.histogram[i];
+  }
+};
+
+// The shared state of one compute() call, handed to the helper threads.
+class Reduction
+{
+  Iop& _input;
+  Op* _op;
+  Box _area;
+  ChannelSet _channels;
+  int _bandHeight;
+  std::vector<Stats> _bands;
+  std::atomic<int> _nextBand;
+  std::atomic<int> _bandsDone;
+
+  static void threadFunc(unsigned, unsigned, void* data)
+  {
+    static_cast<Reduction*>(data)->run(false);
+  }
+
+public:
+  Reduction(Iop& input, Op* op, const Box& area, ChannelMask channels, const Stats& empty)
+    : _input(input), _op(op), _area(area), _channels(channels), _nextBand(0), _bandsDone(0)
+  {
+    // a few bands per thread so a slow band does not leave the others idle
+    const int threads = std::max(1, int(Thread::numThreads));
+    const int bands = std::max(1, std::min(_area.h(), threads * 4));
+    _bandHeight = (_area.h() + bands - 1) / bands;
+    _bands.assign((_area.h() + _bandHeight - 1) / _bandHeight, empty);
+  }
+
+  // Take bands until there are none left. Only the calling thread reports
+  // progress, Op::progressFraction is not meant for helper threads.
+  void run(bool reportProgress)
+  {
+    Row row(_area.x(), _area.r());
+    for (int band = _nextBand++; band < int(_bands.size()); band = _nextBand++) {
+      const int y = _area.y() + band * _bandHeight;
+      const int t = std::min(y + _bandHeight, _area.t());
+      Stats& stats = _bands[band];
+      for (int ry = y; ry < t; ry++) {
+        row.get(_input, ry, _area.x(), _area.r(), _channels);
+        if (_op && _op->aborted())
+          return;
+        foreach (z, _channels)
+          stats.add(row[z] + _area.x(), row[z] + _area.r());
+      }
+      const int done = ++_bandsDone;
+      if (reportProgress && _op)
+        _op->progressFraction(done, int(_bands.size()));
+    }
+  }
+
+  bool compute(Stats& result)
+  {
+    if (_area.w() <= 0 || _area.h() <= 0 || !_channels)
+      return true;
+
+    // one less helper than threads, the calling thread works too
+    const int n = std::min(int(Thread::numThreads) - 1, int(_bands.size()) - 1);
+    if (n > 0)
+      Thread::spawn(threadFunc, n, this);
+    run(true);
+    if (n > 0)
+      Thread::wait(this);
+
+    if (_op && _op->aborted())
+      return false;
+    for (size_t i = 0; i < _bands.size(); i++)
+      result.merge(_bands[i]);
+    return true;
+  }
+};
+
+/*! Scan \a channels of \a input over \a area and merge the results into
+   \a result, whose histogram size and range (if any) are used for the
+   bins. \a op, normally the op doing the analysis, is used for abort
+   checks and progress. Returns false if it was aborted, in which case
+   \a result is untouched.
+ */
+inline bool compute(Iop& input, const Box& area, ChannelMask channels,
+                    Stats& result, Op* op = nullptr)
+{
+  Reduction reduction(input, op, area, channels,
+                      Stats(int(result.histogram.size()), result.lo, result.hi));
+  return reduction.compute(result);
+}
+
+} // namespace ImageStats
+
+#endif
@@ -9,6 +9,9 @@ static const char* const HELP =
 #include "DDImage/Row.h"
 #include "DDImage/Knobs.h"
 
+#include <string.h>
+#include <vector>
+
 using namespace DD::Image;
 
 static const char* const bbox_names[] = {
@@ -101,95 +104,133 @@ public:
     Row maskrow(x, r);
     input(2)->get(y, x, r, maskChannel, maskrow);
 
-    int X = x;
-    int R = r;
-    if (maskrow.is_zero(maskChannel)) {
-      if (!invertMask)
-        return;
-    }
-    else if (!invertMask) {
-      // lets restrict the range in an attempt to speed it up as much
-      // as possible:
-      while (X < R && maskrow[maskChannel][X] <= 0)
-        ++X;
-      while (R > X && maskrow[maskChannel][R - 1] <= 0)
-        --R;
+    if (maskrow.is_zero(maskChannel) && !invertMask)
+      return;
+
+    if (mix < 1) {
+      if (invertMask)
+        keymix<true, true>(y, x, r, copied, maskrow[maskChannel], out);
+      else
+        keymix<false, true>(y, x, r, copied, maskrow[maskChannel], out);
     }
     else {
-      while (X < R && !(maskrow[maskChannel][X] < 1))
-        ++X;
-      while (R > X && !(maskrow[maskChannel][R - 1] < 1))
-        --R;
+      if (invertMask)
+        keymix<true, false>(y, x, r, copied, maskrow[maskChannel], out);
+      else
+        keymix<false, false>(y, x, r, copied, maskrow[maskChannel], out);
     }
-    if (X >= R)
-      return;
+  }
 
-    // row is allocated at full x,r width rather than X,R to try to avoid
-    // memory fragmentation from allocating random sizes:
-    Row arow(x, r);
-    input1().get(y, X, R, copied, arow);
+  // What a pixel of the mask asks for:
+  enum { ONLY_B, BLEND, ONLY_A };
 
+  // B runs shorter than this between runs that need A are fetched from A
+  // along with them, rather than splitting the fetch:
+  static const int kMinGap = 32;
+
+  struct Run
+  {
+    int x, r;
+    int type;
+  };
+
+  template<bool Invert, bool Mixed>
+  int classify(float m) const
+  {
+    if (Mixed) {
+      float v = (Invert ? 1 - m : m) * mix;
+      return v <= 0 ? ONLY_B : v < 1 ? BLEND : ONLY_A;
+    }
+    if (Invert)
+      return m <= 0 ? ONLY_A : m < 1 ? BLEND : ONLY_B;
+    return m <= 0 ? ONLY_B : m < 1 ? BLEND : ONLY_A;
+  }
+
+  /*! Split the mask row into runs of B, A and soft edge. A is only fetched
+     over the runs that need it, B and A runs are bulk copies, and only the
+     soft edge runs are blended.
+   */
+  template<bool Invert, bool Mixed>
+  void keymix(int y, int x, int r, ChannelMask copied, const float* MASK, Row& out)
+  {
+    std::vector<Run> runs;
+    for (int X = x; X < r;) {
+      const int type = classify<Invert, Mixed>(MASK[X]);
+      int R = X + 1;
+      while (R < r && classify<Invert, Mixed>(MASK[R]) == type)
+        ++R;
+      Run run = { X, R, type };
+      runs.push_back(run);
+      X = R;
+    }
+
+    bool needA = false;
+    for (const Run& run : runs)
+      needA |= run.type != ONLY_B;
+    if (!needA)
+      return;
+
+    // the B row must be in the output before A is written over it:
+    const float* BFROM[Chan_Last + 1];
     foreach (z, copied) {
-      const float* AFROM = arow[z];
-      const float* BFROM = out[z];
+      BFROM[z] = out[z];
       float* TO = out.writable(z);
-      // copy unchanged portions on each end:
-      if (TO != BFROM) {
-        if (X > x)
-          memcpy(TO + x, BFROM + x, (X - x) * sizeof(float));
-        if (R < r)
-          memcpy(TO + R, BFROM + R, (r - R) * sizeof(float));
+      if (TO != BFROM[z])
+        memcpy(TO + x, BFROM[z] + x, (r - x) * sizeof(float));
+    }
+
+    // row is allocated at full x,r width rather than each span to try to
+    // avoid memory fragmentation from allocating random sizes:
+    Row arow(x, r);
+    size_t i = 0;
+    while (i < runs.size()) {
+      if (runs[i].type == ONLY_B) {
+        ++i;
+        continue;
       }
-      // Do the middle part:
-      const float* MASK = maskrow[maskChannel];
-      if (mix < 1) {
-        if (invertMask) {
-          for (int xx = X; xx < R; ++xx) {
-            float v = (1 - MASK[xx]) * mix;
-            if (v <= 0)
-              TO[xx] = BFROM[xx];
-            else if (v < 1)
-              TO[xx] = AFROM[xx] * v + BFROM[xx] * (1 - v);
-            else
-              TO[xx] = AFROM[xx];
-          }
-        }
-        else {
-          for (int xx = X; xx < R; ++xx) {
-            float v = MASK[xx] * mix;
-            if (v <= 0)
-              TO[xx] = BFROM[xx];
-            else if (v < 1)
-              TO[xx] = AFROM[xx] * v + BFROM[xx] * (1 - v);
-            else
-              TO[xx] = AFROM[xx];
-          }
-        }
+      // gather the runs needing A, and any short B runs between them
+      size_t end = i + 1;
+      while (end < runs.size()) {
+        if (runs[end].type != ONLY_B)
+          ++end;
+        else if (end + 1 < runs.size() && runs[end].r - runs[end].x < kMinGap)
+          end += 2;
+        else
+          break;
       }
-      else {
-        if (invertMask) {
-          for (int xx = X; xx < R; ++xx) {
-            float v = MASK[xx];
-            if (v <= 0)
-              TO[xx] = AFROM[xx];
-            else if (v < 1)
-              TO[xx] = AFROM[xx] * (1 - v) + BFROM[xx] * v;
-            else
-              TO[xx] = BFROM[xx];
+
+      input1().get(y, runs[i].x, runs[end - 1].r, copied, arow);
+      if (aborted())
+        return;
+
+      foreach (z, copied) {
+        const float* AFROM = arow[z];
+        const float* B = BFROM[z];
+        float* TO = out.writable(z);
+        for (size_t j = i; j < end; ++j) {
+          const Run& run = runs[j];
+          if (run.type == ONLY_A) {
+            memcpy(TO + run.x, AFROM + run.x, (run.r - run.x) * sizeof(float));
           }
-        }
-        else {
-          for (int xx = X; xx < R; ++xx) {
-            float v = MASK[xx];
-            if (v <= 0)
-              TO[xx] = BFROM[xx];
-            else if (v < 1)
-              TO[xx] = AFROM[xx] * v + BFROM[xx] * (1 - v);
-            else
-              TO[xx] = AFROM[xx];
+          else if (run.type == BLEND) {
+            for (int xx = run.x; xx < run.r; ++xx) {
+              if (Mixed) {
+                float v = (Invert ? 1 - MASK[xx] : MASK[xx]) * mix;
+                TO[xx] = AFROM[xx] * v + B[xx] * (1 - v);
+              }
+              else if (Invert) {
+                float v = MASK[xx];
+                TO[xx] = AFROM[xx] * (1 - v) + B[xx] * v;
+              }
+              else {
+                float v = MASK[xx];
+                TO[xx] = AFROM[xx] * v + B[xx] * (1 - v);
+              }
+            }
           }
         }
       }
+      i = end;
     }
   }
 
@@ -6,6 +6,8 @@ static const char* const HELP =
   "Draw various types of noise into the image, all based on the Perlin noise function.";
 
 #include <stdio.h>
+#include <math.h>
+#include <algorithm>
 #include "DDImage/DrawIop.h"
 #include "DDImage/Knob.h"
 #include "DDImage/Knobs.h"
@@ -14,6 +16,8 @@ static const char* const HELP =
 #include "DDImage/Vector3.h"
 #include "DDImage/Matrix4.h"
 
+#include "NoiseSpan.h"
+
 using namespace DD::Image;
 
 enum { FBM, TURBULENCE };
@@ -35,6 +39,9 @@ class Noise : public DrawIop
   Matrix4 matrix;
   Matrix4 invmatrix;
   bool uniform;
+  bool vectorise;
+  bool spanMatches;   // the spans were within kNoiseSpanTolerance of DDImage at the last _validate
+  NoiseSpanFn noiseSpan;
 public:
   Noise(Node* node) : DrawIop(node)
   {
@@ -48,6 +55,9 @@ public:
     gamma = .5;
     rotx = roty = 30;
     matrix.makeIdentity();
+    vectorise = true;
+    spanMatches = false;
+    noiseSpan = SelectNoiseSpan();
   }
 
   void knobs(Knob_Callback f) override
@@ -81,6 +91,12 @@ public:
     Tooltip(f, "Each octave multiplies amplitude by this amount");
     Obsolete_knob(f, "Gain", "knob gain $value");
     Float_knob(f, &gamma, "gamma");
+    Bool_knob(f, &vectorise, "vectorise", "vectorise");
+    Tooltip(f, "Compute a block of pixels at a time with the plugin's own "
+               "float Perlin noise, which is much faster. Whenever the node "
+               "changes a few rows are compared with DDImage's fBm and "
+               "turbulence, and if any value differs by more than 1e-5 those "
+               "are called for every pixel instead, as they are with this off.");
 
     Tab_knob(f, 0, "Transform");
     Transform2d_knob(f, &matrix, "transform", TO_PROXY);
@@ -108,6 +124,7 @@ public:
     m.rotateY(radians(roty));
     m.rotateX(radians(rotx));
     uniform = false;
+    spanMatches = false;
     real_octaves = octaves;
     float det = m.determinant();
     if (!det || octaves < 0) { uniform = true;
@@ -124,6 +141,34 @@ public:
         real_octaves = o;
       //printf("o = %d\n", o);
     }
+    spanMatches = vectorise && for_real && spanMatchesDDImage();
+  }
+
+  /*! Compare spans at the bottom left, middle and top right of the image
+     with DDImage's functions at the same positions, for the current knobs.
+   */
+  bool spanMatchesDDImage()
+  {
+    static const int n = 32;
+    const int xs[3] = { info_.x(), (info_.x() + info_.r()) / 2, info_.r() - n };
+    const int ys[3] = { info_.y(), (info_.y() + info_.t()) / 2, info_.t() - 1 };
+    for (int k = 0; k < 3; k++) {
+      Vector3 a = invmatrix.transform(Vector3(xs[k], ys[k], zsize));
+      Vector3 b = invmatrix.transform(Vector3(xs[k] + n, ys[k], zsize));
+      Vector3 d = (b - a) / float(n);
+      const double start[3] = { a.x, a.y, a.z };
+      const double step[3] = { d.x, d.y, d.z };
+      float values[n];
+      noiseSpan(start, step, n, real_octaves, lacunarity, gain, type == TURBULENCE, values);
+      for (int i = 0; i < n; i++) {
+        const double x = start[0] + step[0] * i, y = start[1] + step[1] * i, z = start[2] + step[2] * i;
+        const double reference = type == TURBULENCE ? turbulence(x, y, z, real_octaves, lacunarity, gain)
+                                                    : fBm(x, y, z, real_octaves, lacunarity, gain);
+        if (!(fabs(values[i] - reference) <= kNoiseSpanTolerance))
+          return false;
+      }
+    }
+    return true;
   }
 
   bool draw_engine(int y, int ix, int r, float* buffer) override
@@ -142,7 +187,16 @@ public:
     Vector3 b = invmatrix.transform(Vector3(r, y, zsize));
     Vector3 d = (b - a) / float(r - ix);
     int x = ix;
-    switch (type) {
+    if (spanMatches) {
+      const double start[3] = { a.x, a.y, a.z };
+      const double step[3] = { d.x, d.y, d.z };
+      noiseSpan(start, step, r - ix, real_octaves, lacunarity, gain, type == TURBULENCE, buffer + ix);
+      if (type == FBM) {
+        for (x = ix; x < r; x++)
+          buffer[x] = (buffer[x] + 1) / 2;
+      }
+    }
+    else switch (type) {
       case FBM:
         while (x < r) {
           Vector3 v = a + d * float(x - ix);
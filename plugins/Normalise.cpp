@@ -15,6 +15,8 @@ using namespace DD::Image;
 #include "DDImage/Knobs.h"
 #include "DDImage/Thread.h"
 
+#include "ImageStats.h"
+
 
 using namespace std;
 
@@ -106,38 +108,16 @@ void Normalise::engine ( int y, int x, int r,
   {
     Guard guard(_lock);
     if ( _firstTime ) {
-      // do anaylsis.
+      // do anaylsis. The other engine threads wait on the lock, but the
+      // scan itself is spread over the thread pool.
       Format format = input0().format();
-
-      // these useful format variables are used later
-      const int fx = format.x();
-      const int fy = format.y();
-      const int fr = format.r();
-      const int ft = format.t();
-
       ChannelSet readChannels = input0().info().channels();
 
-      Interest interest( input0(), fx, fy, fr, ft, readChannels, true );
-      interest.unlock();
-      
-      // fetch each row and find the highest number pixel
-      _maxValue = 0; 
-      for ( int ry = fy; ry < ft; ry++) {
-        progressFraction( ry, ft - fy );
-        Row row( fx, fr );
-        row.get( input0(), ry, fx, fr, readChannels );
-        if ( aborted() )
-          return;
-          
-        foreach( z, readChannels ) {
-          const float *CUR = row[z] + fx;
-          const float *END = row[z] + fr;
-          while ( CUR < END ) {
-            _maxValue = std::max( (float)*CUR, _maxValue );
-            CUR++;
-          }
-        }
-      }
+      // find the highest number pixel
+      ImageStats::Stats stats;
+      if ( !ImageStats::compute( input0(), format, readChannels, stats, this ) )
+        return;
+      _maxValue = std::max( stats.maxValue, 0.0f );
       _firstTime = false;
     }
   } // end lock
@@ -3,7 +3,9 @@
 static const char* const CLASS = "NormaliseExecute";
 
 static const char* const HELP =
-  "Example Normalises input to 1.0 over a frame range";
+  "Example Normalises input to 1.0 over a frame range. The maximum found "
+  "for each frame is remembered in the script along with the hash of the "
+  "input, so executing again only analyses frames whose input changed.";
 
 // Standard plug-in include files.
 
@@ -15,6 +17,11 @@ static const char* const HELP =
 #include "DDImage/Thread.h"
 #include "DDImage/Executable.h"
 
+#include "ImageStats.h"
+
+#include <map>
+#include <sstream>
+
 using namespace std;
 using namespace DD::Image;
 
@@ -31,6 +38,21 @@ class NormaliseExecute : public Iop, Executable
   
   bool _firstTime;
   Lock _lock;
+
+  // Statistics of each frame analysed so far, along with the hash of the
+  // input they were computed from. They are kept in the invisible
+  // stats_cache knob, one "frame hash min max sum count" line per frame,
+  // so they survive saving the script.
+  struct FrameStats
+  {
+    unsigned long long hash;
+    ImageStats::Stats stats;
+  };
+  std::map<double, FrameStats> _frameStats;
+  std::string _statsCache;
+
+  void readStatsCache();
+  void writeStatsCache();
   
 public:
 
@@ -109,16 +131,49 @@ void NormaliseExecute::_open()
 {
 }
 
+void NormaliseExecute::readStatsCache()
+{
+  _frameStats.clear();
+  std::istringstream in( _statsCache );
+  std::string line;
+  while ( std::getline( in, line ) ) {
+    std::istringstream fields( line );
+    double frame;
+    FrameStats entry;
+    fields >> frame >> std::hex >> entry.hash >> std::dec
+           >> entry.stats.minValue >> entry.stats.maxValue
+           >> entry.stats.sum >> entry.stats.count;
+    if ( fields )
+      _frameStats[frame] = entry;
+  }
+}
+
+void NormaliseExecute::writeStatsCache()
+{
+  std::ostringstream out;
+  out.precision( 17 );
+  for ( std::map<double, FrameStats>::const_iterator i = _frameStats.begin(); i != _frameStats.end(); ++i ) {
+    const ImageStats::Stats& stats = i->second.stats;
+    out << i->first << ' ' << std::hex << i->second.hash << std::dec << ' '
+        << stats.minValue << ' ' << stats.maxValue << ' '
+        << stats.sum << ' ' << stats.count << '\n';
+  }
+  _statsCache = out.str();
+  knob("stats_cache")->set_text( _statsCache.c_str() );
+}
+
 void NormaliseExecute::beginExecuting()
 {
   std::cerr << "Begin Executing." << std::endl;
   _maxValue = _calcMaxValue  = 0;
+  readStatsCache();
 }
 
 void NormaliseExecute::endExecuting()
 {
   std::cerr <<"End Executing." << std::endl;
   knob("maxValue")->set_value( _calcMaxValue );
+  writeStatsCache();
 }  
 
 
@@ -126,43 +181,35 @@ void NormaliseExecute::execute()
 {
   // do anaylsis for current frame
   Format format = input0().format();
-
-  // these useful format variables are used later
-  const int fx = format.x();
-  const int fy = format.y();
-  const int fr = format.r();
-  const int ft = format.t();
-
   ChannelSet readChannels = input0().info().channels();
 
-  
-  Interest interest( input0(), fx, fy, fr, ft, readChannels, true );
-  interest.unlock();
-  
-  // fetch each row and find the highest number pixel
+  // reuse the statistics from an earlier execute if the input is unchanged
   _maxValue = 0; 
-  for ( int ry = fy; ry < ft; ry++) {
-    progressFraction( ry, ft - fy );
-    Row row( fx, fr );
-    row.get( input0(), ry, fx, fr, readChannels );
-    if ( aborted() )
-      return;
-      
-    foreach( z, readChannels ) {
-      const float *CUR = row[z] + fx;
-      const float *END = row[z] + fr;
-      while ( CUR < END ) {
-        _calcMaxValue = std::max( (float)*CUR, (float)_calcMaxValue );
-        CUR++;
-      }
-    }
+  const double frame = outputContext().frame();
+  const unsigned long long hash = input0().hash().value();
+  std::map<double, FrameStats>::const_iterator cached = _frameStats.find( frame );
+  if ( cached != _frameStats.end() && cached->second.hash == hash ) {
+    _calcMaxValue = std::max( cached->second.stats.maxValue, (float)_calcMaxValue );
+    return;
   }
 
+  // find the highest number pixel, scanning in parallel
+  ImageStats::Stats stats;
+  if ( !ImageStats::compute( input0(), format, readChannels, stats, this ) )
+    return;
+  _calcMaxValue = std::max( stats.maxValue, (float)_calcMaxValue );
+
+  FrameStats& entry = _frameStats[frame];
+  entry.hash = hash;
+  entry.stats = stats;
 }
 
 
 void NormaliseExecute::knobs( Knob_Callback f ) {
    Float_knob(f,  &_maxValue, IRange(0,5), "maxValue", "Max");
+   // the per frame statistics, see readStatsCache()
+   String_knob(f, &_statsCache, "stats_cache");
+   SetFlags(f, Knob::INVISIBLE | Knob::NO_UNDO | Knob::NO_RERENDER);
    Divider(f);
    const char* renderScript = "currentNode = nuke.toNode(\"this\")\n"
    "nodeList = [currentNode]\n"
@@ -3,7 +3,13 @@
 static const char* const CLASS = "SimpleBlur";
 
 static const char* const HELP =
-  "Does a simple box blur";
+  "Does a simple box blur.\n\n"
+  "The separable filter computes the vertical sums once per band of rows "
+  "and then runs a sliding sum along each row, so the cost per pixel does "
+  "not depend on the size. The naive filter is the original (2*size)^2 "
+  "tap loop, kept as a reference.\n\n"
+  "The gaussian filter chains 3 to 5 box passes in each direction, with "
+  "widths chosen to match the sigma, all inside this one node.";
 
 // Standard plug-in include files.
 
@@ -13,13 +19,63 @@ using namespace DD::Image;
 #include "DDImage/Row.h"
 #include "DDImage/Tile.h"
 #include "DDImage/Knobs.h"
+#include "DDImage/Thread.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
 
 using namespace std;
 
+static const char* const filterNames[] = { "box", "box (naive)", "gaussian (n-pass box)", 0 };
+
+enum { FILTER_BOX, FILTER_NAIVE, FILTER_GAUSSIAN };
+
+// A 1D box pass covers the inclusive offsets [lo, hi] around each pixel.
+struct BoxPass
+{
+  int lo, hi;
+};
+
+// Bands are never shorter than this, so that the vertical window sum which
+// starts each band is spread over at least this many output rows:
+static const int kMinBandHeight = 64;
+
 class SimpleBlur : public Iop
 {
 
   int _size;
+  int _filter;
+  double _sigma;
+  int _passCount;
+
+  // Vertically filtered input for a band of output rows, computed once by
+  // whichever engine thread gets there first and then only read.
+  struct Band
+  {
+    Lock lock;
+    bool ready;
+    int y, t;
+    std::map<Channel, std::vector<float> > planes;
+    Band() : ready(false), y(0), t(0) {}
+  };
+
+  // The box passes run in each direction, and how far they reach in total.
+  std::vector<BoxPass> _passes;
+  int _pad;
+
+  // Input area the bands cover: the requested area clipped to the input bbox.
+  Box _area;
+  ChannelSet _bandChannels;
+  int _bandHeight;
+  std::map<int, std::unique_ptr<Band> > _bands;
+  Lock _bandsLock;
+
+  void clearBands();
+  Band* getBand(int y);
+  bool fillBand(Band& band);
+  void naiveEngine(int y, int x, int r, ChannelMask channels, Row& out);
   
 public:
 
@@ -31,12 +87,18 @@ public:
   SimpleBlur (Node* node) : Iop (node)
   {
     _size = 20;
+    _filter = FILTER_BOX;
+    _sigma = 10;
+    _passCount = 3;
+    _pad = 0;
+    _bandHeight = kMinBandHeight;
   }
 
   ~SimpleBlur () {}
   
   void _validate(bool);
   void _request(int x, int y, int r, int t, ChannelMask channels, int count);
+  void knobs(Knob_Callback f);
   
   //! This function does all the work.
 
@@ -70,19 +132,243 @@ const Iop::Description SimpleBlur::description ( CLASS, "Merge/SimpleBlur",
                                                      SimpleBlurCreate );
 
 
+void SimpleBlur::knobs(Knob_Callback f)
+{
+  Int_knob(f, &_size, "size", "size");
+  Enumeration_knob(f, &_filter, filterNames, "filter", "filter");
+  Tooltip(f, "box: separable running sum, constant cost per pixel.\n"
+             "box (naive): the original per-pixel tile loop.\n"
+             "gaussian (n-pass box): several running-sum box passes matching sigma.");
+  Double_knob(f, &_sigma, IRange(0, 100), "sigma", "sigma");
+  Tooltip(f, "Standard deviation of the gaussian filter. Not used by the box filters.");
+  Int_knob(f, &_passCount, IRange(3, 5), "passes", "passes");
+  Tooltip(f, "Number of box passes per direction for the gaussian filter (3 to 5). "
+             "More passes are closer to a true gaussian, each pass costs the same.");
+}
+
+/*! Pick n box widths whose cascade has the variance of a gaussian of the
+   given sigma: m passes of the odd width wl and the rest of wl + 2.
+ */
+static void boxesForGauss(double sigma, int n, std::vector<BoxPass>& passes)
+{
+  const double wIdeal = sqrt(12 * sigma * sigma / n + 1);
+  int wl = int(floor(wIdeal));
+  if ( wl % 2 == 0 )
+    wl--;
+  const int wu = wl + 2;
+  const double mIdeal = (12 * sigma * sigma - n * wl * wl - 4 * n * wl - 3 * n) / (-4.0 * wl - 4);
+  const int m = std::max(0, std::min(n, int(floor(mIdeal + 0.5))));
+
+  passes.clear();
+  for ( int i = 0; i < n; i++ ) {
+    const int radius = ((i < m ? wl : wu) - 1) / 2;
+    if ( radius > 0 ) {
+      BoxPass pass = { -radius, radius };
+      passes.push_back(pass);
+    }
+  }
+}
+
 void SimpleBlur::_validate(bool for_real)
 {
   copy_info(); // copy bbox channels etc from input0, which will validate it.
-  info_.pad( _size);
-  
+
+  _passes.clear();
+  _pad = 0;
+  if ( _filter == FILTER_GAUSSIAN ) {
+    boxesForGauss(_sigma, std::max(3, std::min(5, _passCount)), _passes);
+    for ( size_t i = 0; i < _passes.size(); i++ )
+      _pad += _passes[i].hi;
+  }
+  else if ( _size > 0 ) {
+    // the box covers offsets [-size, size) in both directions
+    BoxPass pass = { -_size, _size - 1 };
+    _passes.push_back(pass);
+    _pad = _size;
+  }
+
+  info_.pad( _pad);
+
+  if ( _passes.empty() ) {
+    set_out_channels( Mask_None );
+    return;
+  }
+  set_out_channels( Mask_All );
+
+  int span = 0;
+  for ( size_t i = 0; i < _passes.size(); i++ )
+    span += _passes[i].hi - _passes[i].lo;
+  _bandHeight = std::max(kMinBandHeight, span + 1);
+  clearBands();
 }
 
 void SimpleBlur::_request(int x, int y, int r, int t, ChannelMask channels, int count)
 {
   // request extra pixels around the input
-  input(0)->request( x - _size , y - _size , r + _size, t + _size, channels, count );
+  input(0)->request( x - _pad , y - _pad , r + _pad, t + _pad, channels, count );
+
+  // the bands only ever read what was requested, clipped to the input bbox
+  Box area( x - _pad , y - _pad , r + _pad, t + _pad );
+  area.intersect( input0().info() );
+  ChannelSet bandChannels = channels;
+  bandChannels &= input0().info().channels();
+
+  Guard guard(_bandsLock);
+  _area = area;
+  _bandChannels = bandChannels;
+  _bands.clear();
+}
+
+void SimpleBlur::clearBands()
+{
+  Guard guard(_bandsLock);
+  _bands.clear();
+}
+
+/*! Return the band holding output row y, filling it if no other thread
+   has done so yet. Returns 0 if filling was aborted.
+ */
+SimpleBlur::Band* SimpleBlur::getBand(int y)
+{
+  // floor division so rows below the origin land in negative bands
+  const int offset = y - info_.y();
+  const int index = offset >= 0 ? offset / _bandHeight : -((-offset + _bandHeight - 1) / _bandHeight);
+
+  Band* band;
+  {
+    Guard guard(_bandsLock);
+    std::unique_ptr<Band>& slot = _bands[index];
+    if (!slot) {
+      slot.reset(new Band);
+      slot->y = info_.y() + index * _bandHeight;
+      slot->t = slot->y + _bandHeight;
+    }
+    band = slot.get();
+  }
+
+  Guard guard(band->lock);
+  if (!band->ready && !fillBand(*band))
+    return 0;
+  return band;
 }
 
+static inline int clampIndex(int v, int lo, int hi)
+{
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/*! One running-sum box pass over whole rows of width floats: output row i is
+   the mean of the source rows [y + i + lo, y + i + hi], where src(y) returns
+   a pointer to the source row y. Costs one add and one subtract per pixel.
+ */
+template<class SrcRow>
+static void boxPassRows(SrcRow src, int y, int rows, int width, const BoxPass& pass,
+                        float* dst, std::vector<double>& acc)
+{
+  const double div = pass.hi - pass.lo + 1;
+
+  acc.assign(width, 0.0);
+  for ( int py = pass.lo; py <= pass.hi; py++ ) {
+    const float* in = src(y + py);
+    for ( int i = 0; i < width; i++ )
+      acc[i] += in[i];
+  }
+
+  for ( int row = 0; row < rows; row++ ) {
+    float* out = dst + size_t(row) * width;
+    for ( int i = 0; i < width; i++ )
+      out[i] = float(acc[i] / div);
+    if ( row + 1 < rows ) {
+      const float* add = src(y + row + pass.hi + 1);
+      const float* sub = src(y + row + pass.lo);
+      for ( int i = 0; i < width; i++ )
+        acc[i] += add[i] - sub[i];
+    }
+  }
+}
+
+/*! The same pass along a single line: dst[i] is the mean of src(x + i + lo)
+   to src(x + i + hi).
+ */
+template<class Src>
+static void boxPassLine(Src src, int x, int count, const BoxPass& pass, float* dst)
+{
+  const double div = pass.hi - pass.lo + 1;
+
+  double sum = 0;
+  for ( int px = pass.lo; px <= pass.hi; px++ )
+    sum += src(x + px);
+  for ( int i = 0; i < count; i++ ) {
+    dst[i] = float(sum / div);
+    if ( i + 1 < count )
+      sum += src(x + i + pass.hi + 1) - src(x + i + pass.lo);
+  }
+}
+
+/*! Vertical passes: run every box pass down the columns of _area for the
+   rows of the band. The first pass reads the input rows clamped to _area,
+   the others read the previous pass, each pass producing exactly the rows
+   the next one needs.
+ */
+bool SimpleBlur::fillBand(Band& band)
+{
+  const int width = _area.r() - _area.x();
+  const int n = int(_passes.size());
+
+  // rows produced by each pass, working back from the band itself
+  std::vector<int> firstRow(n), lastRow(n);
+  firstRow[n - 1] = band.y;
+  lastRow[n - 1] = band.t - 1;
+  for ( int k = n - 1; k > 0; k-- ) {
+    firstRow[k - 1] = firstRow[k] + _passes[k].lo;
+    lastRow[k - 1] = lastRow[k] + _passes[k].hi;
+  }
+  const int ty = clampIndex(firstRow[0] + _passes[0].lo, _area.y(), _area.t() - 1);
+  const int tt = clampIndex(lastRow[0] + _passes[0].hi, _area.y(), _area.t() - 1) + 1;
+
+  Tile tile( input0(), _area.x(), ty, _area.r(), tt, _bandChannels );
+  if ( aborted() )
+    return false;
+
+  std::vector<double> acc;
+  std::vector<float> buffers[2];
+
+  foreach ( z, _bandChannels ) {
+    std::vector<float>& plane = band.planes[z];
+    plane.assign(size_t(band.t - band.y) * width, 0.0f);
+    if ( !tile.valid() || !intersect( tile.channels(), z ) )
+      continue;
+
+    const float* prev = 0;
+    int prevY = 0;
+    for ( int k = 0; k < n; k++ ) {
+      const int rows = lastRow[k] - firstRow[k] + 1;
+      float* dst;
+      if ( k == n - 1 ) {
+        dst = &plane[0];
+      }
+      else {
+        buffers[k & 1].resize(size_t(rows) * width);
+        dst = &buffers[k & 1][0];
+      }
+
+      if ( k == 0 ) {
+        const int ax = _area.x();
+        boxPassRows([&](int yy) { return &tile[z][ tile.clampy(yy) ][ ax ]; },
+                    firstRow[k], rows, width, _passes[k], dst, acc);
+      }
+      else {
+        boxPassRows([&](int yy) { return prev + size_t(yy - prevY) * width; },
+                    firstRow[k], rows, width, _passes[k], dst, acc);
+      }
+      prev = dst;
+      prevY = firstRow[k];
+    }
+  }
+
+  band.ready = true;
+  return true;
+}
 
 /*! For each line in the area passed to request(), this will be called. It must
    calculate the image data for a region at vertical position y, and between
@@ -94,6 +380,73 @@ void SimpleBlur::_request(int x, int y, int r, int t, ChannelMask channels, int
 void SimpleBlur::engine ( int y, int x, int r,
                               ChannelMask channels, Row& row )
 {
+  if ( _filter == FILTER_NAIVE ) {
+    naiveEngine( y, x, r, channels, row );
+    return;
+  }
+
+  ChannelSet blurred = channels;
+  blurred &= _bandChannels;
+
+  // channels the input does not have are black
+  foreach ( z, channels ) {
+    if ( !intersect( blurred, z ) || _area.r() <= _area.x() || _area.t() <= _area.y() )
+      memset( row.writable(z) + x, 0, (r - x) * sizeof(float) );
+  }
+  if ( !blurred || _area.r() <= _area.x() || _area.t() <= _area.y() )
+    return;
+
+  Band* band = getBand( y );
+  if ( !band ) {
+    std::cerr << "Aborted!";
+    return;
+  }
+
+  // Horizontal passes over the vertical result, the first one clamped to the
+  // columns of _area the same way the naive loop clamps to its tile.
+  const int ax = _area.x();
+  const int ar = _area.r() - 1;
+  const int n = int(_passes.size());
+
+  std::vector<int> firstX(n), lastX(n);
+  firstX[n - 1] = x;
+  lastX[n - 1] = r - 1;
+  for ( int k = n - 1; k > 0; k-- ) {
+    firstX[k - 1] = firstX[k] + _passes[k].lo;
+    lastX[k - 1] = lastX[k] + _passes[k].hi;
+  }
+  std::vector<float> buffers[2];
+
+  foreach ( z, blurred ) {
+    const float* vs = &band->planes.at(z)[ size_t(y - band->y) * (ar + 1 - ax) ] - ax;
+
+    const float* prev = 0;
+    int prevX = 0;
+    for ( int k = 0; k < n; k++ ) {
+      const int count = lastX[k] - firstX[k] + 1;
+      float* dst;
+      if ( k == n - 1 ) {
+        dst = row.writable(z) + x;
+      }
+      else {
+        buffers[k & 1].resize(count);
+        dst = &buffers[k & 1][0];
+      }
+
+      if ( k == 0 )
+        boxPassLine([&](int xx) { return vs[ clampIndex(xx, ax, ar) ]; }, firstX[k], count, _passes[k], dst);
+      else
+        boxPassLine([&](int xx) { return prev[ xx - prevX ]; }, firstX[k], count, _passes[k], dst);
+      prev = dst;
+      prevX = firstX[k];
+    }
+  }
+}
+
+/*! The original box blur: a full (2*size)^2 tap loop for every pixel. */
+void SimpleBlur::naiveEngine ( int y, int x, int r,
+                               ChannelMask channels, Row& row )
+{
  
   // make a tile for current line with padding arond for the blur
   Tile tile( input0(), x - _size , y - _size , r + _size, y + _size , channels);  
@@ -12,21 +12,147 @@ static const char* const HELP =
 #include "DDImage/Knobs.h"
 #include "DDImage/ImageCache.h"
 #include "DDImage/ChannelSet.h"
+#include "DDImage/Thread.h"
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+
+#include "HalfFloat.h"
 
 using namespace std;
 using namespace DD::Image;
 
+// The output is blurred, and cached, in square blocks of this many pixels.
+// Each block is computed by one thread from its pixels plus the blur size
+// around them, and has its own cache entry:
+static const int kBlockSize = 256;
+
+// Every cached block starts with this header, followed by 'words' 16 bit
+// words: the block's RGBA half floats, run-length encoded if flagged.
+struct BlockCacheHeader
+{
+  unsigned int magic;
+  unsigned int flags;
+  unsigned int words;
+};
+
+static const unsigned int kBlockCacheMagic = 0x53424331; // "SBC1"
+
+enum { BLOCK_CACHE_RLE = 1 };
+
+// Result rows are padded to a multiple of this many floats (one cache line):
+static const int kRowAlign = 16;
+
+/* Index of an RGBA channel in the result planes and cached blocks. */
+static inline int rgbaIndex(Channel z)
+{
+  if(z == Chan_Green)
+    return 1;
+  else if(z == Chan_Blue)
+    return 2;
+  else if(z == Chan_Alpha)
+    return 3;
+  return 0;
+}
+
+/* Run-length encode 16 bit words. A control word with the top bit set is
+   followed by one word repeated (control & 0x7fff) times, otherwise it is
+   followed by that many literal words. */
+static void rleEncode(const std::vector<unsigned short>& in, std::vector<unsigned short>& out)
+{
+  const size_t n = in.size();
+  out.clear();
+  out.reserve(n + n / 0x7fff + 1);
+
+  size_t i = 0;
+  while (i < n) {
+    size_t j = i + 1;
+    while (j < n && in[j] == in[i] && j - i < 0x7fff)
+      j++;
+    if (j - i >= 3) {
+      out.push_back((unsigned short)(0x8000 | (j - i)));
+      out.push_back(in[i]);
+      i = j;
+      continue;
+    }
+
+    // literal words up to the next run of three or more
+    const size_t start = i;
+    while (i < n && i - start < 0x7fff &&
+           !(i + 2 < n && in[i] == in[i + 1] && in[i] == in[i + 2]))
+      i++;
+    out.push_back((unsigned short)(i - start));
+    out.insert(out.end(), in.begin() + start, in.begin() + i);
+  }
+}
+
+static bool rleDecode(const std::vector<unsigned short>& in, std::vector<unsigned short>& out)
+{
+  size_t o = 0;
+  size_t i = 0;
+  while (i < in.size()) {
+    const size_t count = in[i] & 0x7fff;
+    if (in[i++] & 0x8000) {
+      if (i >= in.size() || o + count > out.size())
+        return false;
+      std::fill(out.begin() + o, out.begin() + o + count, in[i++]);
+    }
+    else {
+      if (i + count > in.size() || o + count > out.size())
+        return false;
+      std::copy(in.begin() + i, in.begin() + i + count, out.begin() + o);
+      i += count;
+    }
+    o += count;
+  }
+  return o == out.size();
+}
+
 class SimpleBlurCached : public Iop
 {
   int _param_blur;
   float _param_constant;
+  bool _param_compress;
   bool _isFirstTime;
 
-  std::vector<float> vec_dst_image;
+  // The result, one plane per RGBA channel of _rowStride floats per row,
+  // every row starting on a cache line so engine() can memcpy any span.
+  std::vector<float> _planeStorage;
+  float* _planes[4];
+  size_t _rowStride;
+
+  float* planeRow(int c, int y) { return _planes[c] + size_t(y) * _rowStride; }
+
+  // One kBlockSize square of the result. Whoever holds the lock reads or
+  // computes it, everybody else waits on the lock for it to be done.
+  struct Block
+  {
+    Lock lock;
+    std::atomic<bool> done;
+    Block() : done(false) {}
+  };
+
+  std::unique_ptr<Block[]> _blocks;
+  int _blocksX, _blocksY;
+  Box _requestedBlocks;           // block indexes covering the requested box
+  std::atomic<int> _nextBlock;    // next requested block for the helper threads
 
   Lock _lock;
+  Lock _cacheLock;                // Image_Cache reports read/write status globally
+
+  bool fetchRGBAImage(std::vector<float>&, const int x, const int y, const int r, const int t);
 
-  bool fetchRGBAImage(std::vector<float>&, const int height, const int width);
+  void blockArea(int bx, int by, int& x, int& y, int& r, int& t) const;
+  DD::Image::Hash blockHash(int bx, int by) const;
+  bool readBlock(int bx, int by);
+  void writeBlock(int bx, int by);
+  bool blurBlock(int bx, int by);
+  void quantizeBlock(int bx, int by);
+  void addConstant(int bx, int by);
+  bool computeBlock(int bx, int by);
+  static void blockThreadFunc(unsigned int threadNum, unsigned int, void* data);
 
   /* Return available RGBA channels */
   ChannelSet getNeededChannels() const;
@@ -41,10 +167,16 @@ public:
   {
     _param_blur = 1;
     _param_constant = 0;
+    _param_compress = false;
     _isFirstTime = true;
+    _blocksX = _blocksY = 0;
+    _nextBlock = 0;
+    _planes[0] = _planes[1] = _planes[2] = _planes[3] = 0;
+    _rowStride = 0;
   }
 
-  ~SimpleBlurCached () {}
+  // helper threads may still be finishing blocks of an aborted render
+  ~SimpleBlurCached () { Thread::wait(this); }
 
   void _validate(bool);
   void _request(int x, int y, int r, int t, ChannelMask channels, int count);
@@ -88,6 +220,12 @@ void SimpleBlurCached::_validate(bool for_real)
 {
   copy_info(); // copy bbox channels etc from input0, which will validate it.
 
+  // the helper threads use the block state, let them finish before it is reset
+  Thread::wait(this);
+
+  _blocksX = (info_.w() + kBlockSize - 1) / kBlockSize;
+  _blocksY = (info_.h() + kBlockSize - 1) / kBlockSize;
+  _requestedBlocks.set(_blocksX, _blocksY, 0, 0);
   _isFirstTime = true;
 }
 
@@ -96,41 +234,50 @@ void SimpleBlurCached::_request(int x, int y, int r, int t, ChannelMask channels
   // Add available RGBA channels so that we can pull them when setting up the cache
   ChannelSet requiredChannels = channels + getNeededChannels();
 
-  input(0)->request(0, 0, info_.w(), info_.h(), requiredChannels, count);
+  // only the blocks touching the requested box are computed up front, they
+  // need their pixels plus the blur size around them
+  const int width = info_.w();
+  const int height = info_.h();
+  _requestedBlocks.set(std::min(_requestedBlocks.x(), std::max(0, x / kBlockSize)),
+                       std::min(_requestedBlocks.y(), std::max(0, y / kBlockSize)),
+                       std::max(_requestedBlocks.r(), std::min(_blocksX, (r + kBlockSize - 1) / kBlockSize)),
+                       std::max(_requestedBlocks.t(), std::min(_blocksY, (t + kBlockSize - 1) / kBlockSize)));
+
+  const int inX = std::max(0, _requestedBlocks.x() * kBlockSize - _param_blur);
+  const int inY = std::max(0, _requestedBlocks.y() * kBlockSize - _param_blur);
+  const int inR = std::min(width, _requestedBlocks.r() * kBlockSize + _param_blur);
+  const int inT = std::min(height, _requestedBlocks.t() * kBlockSize + _param_blur);
+  input(0)->request(inX, inY, std::max(inX, inR), std::max(inY, inT), requiredChannels, count);
 }
 
 void SimpleBlurCached::knobs(Knob_Callback f)
 {
   Int_knob(f,  &_param_blur, "size", "size");
   Float_knob(f, &_param_constant, "constant", "constant");
+  Bool_knob(f, &_param_compress, "compress_cache", "compress cache");
+  Tooltip(f, "Run-length encode the half float blocks written to the disk cache. "
+             "Saves space on images with flat areas, at a small cost in CPU.");
 }
 
-bool SimpleBlurCached::fetchRGBAImage(std::vector<float>& vec, const int height, const int width)
+bool SimpleBlurCached::fetchRGBAImage(std::vector<float>& vec, const int x, const int y, const int r, const int t)
 {
   ChannelSet rgbaChannels = getNeededChannels();
 
-  Tile tile(input0(), 0, 0, width, height, rgbaChannels);
+  Tile tile(input0(), x, y, r, t, rgbaChannels);
   if (aborted()) {
     return false;
   }
 
-  vec.resize(width * height * 4);
+  const int width = r - x;
+  vec.assign(width * (t - y) * 4, 0.0f);
 
   foreach(z, rgbaChannels) {
 
-    int channel_skip = 0;
-    if(z == Chan_Red)
-      channel_skip = 0;
-    else if(z == Chan_Green)
-      channel_skip = 1;
-    else if(z == Chan_Blue)
-      channel_skip = 2;
-    else if(z == Chan_Alpha)
-      channel_skip = 3;
-
-    for (int py = 0; py < height; ++py) {
-      for (int px = 0; px < width; ++px) {
-        const size_t index = (py*width + px)*4 + channel_skip;
+    const int channel_skip = rgbaIndex(z);
+
+    for (int py = y; py < t; ++py) {
+      for (int px = x; px < r; ++px) {
+        const size_t index = ((py - y)*width + (px - x))*4 + channel_skip;
         float value = tile[z][py][px];
 
         vec[index] = value;
@@ -141,91 +288,278 @@ bool SimpleBlurCached::fetchRGBAImage(std::vector<float>& vec, const int height,
   return true;
 }
 
-void SimpleBlurCached::engine ( int y, int x, int r,
-                              ChannelMask channels, Row& row )
+void SimpleBlurCached::blockArea(int bx, int by, int& x, int& y, int& r, int& t) const
+{
+  x = bx * kBlockSize;
+  y = by * kBlockSize;
+  r = std::min(info_.w(), x + kBlockSize);
+  t = std::min(info_.h(), y + kBlockSize);
+}
+
+/*! Each block has its own cache entry, so a partial request only touches
+   the entries of the blocks it covers.
+ */
+DD::Image::Hash SimpleBlurCached::blockHash(int bx, int by) const
+{
+  int x, y, r, t;
+  blockArea(bx, by, x, y, r, t);
+
+  DD::Image::Hash hash;
+  hash.reset();
+  hash.append(input0().hash());
+  hash.append(_param_blur);
+  hash.append(x);
+  hash.append(y);
+  hash.append(r);
+  hash.append(t);
+  hash.append(kBlockCacheMagic);
+  return hash;
+}
+
+/*! Try to fill a block of the result from the cache. */
+bool SimpleBlurCached::readBlock(int bx, int by)
+{
+  Image_Cache *i_cache = &Image_Cache::mainCache();
+
+  int x, y, r, t;
+  blockArea(bx, by, x, y, r, t);
+  const size_t words = size_t(r - x) * (t - y) * 4;
+
+  DD::Image::Hash hash = blockHash(bx, by);
+
+  std::vector<unsigned short> halves(words);
+  std::vector<unsigned short> payload;
+  {
+    Guard guard(_cacheLock);
+
+    /* is this block already in the cache? */
+    if (!i_cache->is_active() || !i_cache->has_file(hash))
+      return false;
+
+    DD::Image::ImageCacheReadI* cache_read = i_cache->open( hash );
+
+    BlockCacheHeader header;
+    bool cache_read_success =
+      cache_read->read(&header, sizeof(header)) == sizeof(header) && i_cache->is_read() &&
+      header.magic == kBlockCacheMagic &&
+      (header.flags & BLOCK_CACHE_RLE ? header.words <= words + words / 0x7fff + 1 : header.words == words);
+
+    if (cache_read_success) {
+      payload.resize(header.words);
+      size_t desired_read_bytes = payload.size() * sizeof(unsigned short);
+      cache_read_success = cache_read->read(payload.data(), desired_read_bytes) == desired_read_bytes &&
+                           i_cache->is_read();
+    }
+
+    cache_read->close();
+
+    if (!cache_read_success)
+      return false;
+
+    if (header.flags & BLOCK_CACHE_RLE) {
+      if (!rleDecode(payload, halves))
+        return false;
+    }
+    else {
+      halves.swap(payload);
+    }
+  }
+
+  /* blocks are cached as interleaved RGBA */
+  const unsigned short* src = halves.data();
+  for (int py = y; py < t; py++) {
+    float* dst[4] = { planeRow(0, py), planeRow(1, py), planeRow(2, py), planeRow(3, py) };
+    for (int px = x; px < r; px++) {
+      for (int c = 0; c < 4; c++)
+        dst[c][px] = halfToFloat(*src++);
+    }
+  }
+  return true;
+}
+
+/*! Save a computed block of the result to the cache as half floats. */
+void SimpleBlurCached::writeBlock(int bx, int by)
+{
+  Image_Cache *i_cache = &Image_Cache::mainCache();
+  if (!i_cache->is_active())
+    return;
+
+  int x, y, r, t;
+  blockArea(bx, by, x, y, r, t);
+
+  std::vector<unsigned short> halves;
+  halves.reserve(size_t(r - x) * (t - y) * 4);
+  for (int py = y; py < t; py++) {
+    const float* src[4] = { planeRow(0, py), planeRow(1, py), planeRow(2, py), planeRow(3, py) };
+    for (int px = x; px < r; px++) {
+      for (int c = 0; c < 4; c++)
+        halves.push_back(floatToHalf(src[c][px]));
+    }
+  }
+
+  BlockCacheHeader header;
+  header.magic = kBlockCacheMagic;
+  header.flags = 0;
+  if (_param_compress) {
+    std::vector<unsigned short> packed;
+    rleEncode(halves, packed);
+    if (packed.size() < halves.size()) {
+      halves.swap(packed);
+      header.flags |= BLOCK_CACHE_RLE;
+    }
+  }
+  header.words = (unsigned int)halves.size();
+
+  /* write result to cache */
+  Guard guard(_cacheLock);
+  DD::Image::ImageCacheWriteI* cache_write = i_cache->create( blockHash(bx, by) );
+  size_t desired_write_bytes = halves.size() * sizeof(unsigned short);
+
+  cache_write->write(&header, sizeof(header));
+  cache_write->write(halves.data(), desired_write_bytes);
+
+  if (!i_cache->is_written())
+    printf("Error saving blurred block to cache (is written: %d).\n", (int)i_cache->is_written());
+
+  cache_write->close();
+}
+
+/*! Blur one block into the result planes, fetching only the input pixels that
+   block needs.
+ */
+bool SimpleBlurCached::blurBlock(int bx, int by)
 {
   const int width = info_.w();
   const int height = info_.h();
 
-  // engine calls are multi-threaded so any processing must be locked
-  if (_isFirstTime) {
-    Guard guard(_lock);
-    if (_isFirstTime) {
+  int x, y, r, t;
+  blockArea(bx, by, x, y, r, t);
+  const int srcX = std::max(0, x - _param_blur);
+  const int srcY = std::max(0, y - _param_blur);
+  const int srcR = std::min(width, r + _param_blur);
+  const int srcT = std::min(height, t + _param_blur);
+  const int srcW = srcR - srcX;
 
-      const size_t totalPixels = width * height * 4;
+  std::vector<float> vec_src_image;
+  if (!fetchRGBAImage(vec_src_image, srcX, srcY, srcR, srcT))
+    return false;
 
-      std::vector<float> vec_src_image;
-      vec_dst_image.resize(totalPixels);
+  /* blur the image, very naively, do not use this code for anything useful! */
+  float blur_sum; int blur_counter;
+  for(int i=y;i<t;i++)
+    for(int j=x;j<r;j++)
+      for(int c=0;c<4;c++){
+        blur_sum = 0; blur_counter = 0;
+        for (int u=std::max(0,i-_param_blur); u<=std::min(height-1,i+_param_blur); u++)
+          for (int v=std::max(0,j-_param_blur); v<=std::min(width-1,j+_param_blur); v++){
+            blur_sum += vec_src_image[((u-srcY)*srcW + (v-srcX))*4 + c];
+            blur_counter++;
+          }
+        planeRow(c, i)[j] = (blur_counter > 0) ? blur_sum / (float)blur_counter : 0;
+      }
 
-      /* try fetch input image */
-      if (fetchRGBAImage(vec_src_image, height, width) ) {
-        /* now going to see if the input is in the cache */
-        Image_Cache *i_cache = &Image_Cache::mainCache();
-        printf("Checking active cache: %d.\n", i_cache->is_active());
+  return true;
+}
 
-        size_t desired_read_bytes = (vec_src_image.size())*sizeof(float);
+/*! Round a computed block to half floats, as the cache stores it, so that
+   a frame looks the same whether its blocks came from the cache or not.
+ */
+void SimpleBlurCached::quantizeBlock(int bx, int by)
+{
+  int x, y, r, t;
+  blockArea(bx, by, x, y, r, t);
+  for (int c = 0; c < 4; c++) {
+    for (int py = y; py < t; py++) {
+      float* dst = planeRow(c, py);
+      for (int px = x; px < r; px++)
+        dst[px] = halfToFloat(floatToHalf(dst[px]));
+    }
+  }
+}
 
-        DD::Image::Hash hash;
-        hash.reset();
-        hash.append(input0().hash());
-        hash.append(_param_blur);
-        printf("Printing hash value: %d.\n", (int)hash.value());
-        printf("Has file: %d.\n", i_cache->has_file(hash));
+/*! The cache holds the plain blur, the constant is added once a block is
+   in memory so that rows can be served as they are.
+ */
+void SimpleBlurCached::addConstant(int bx, int by)
+{
+  if (_param_constant == 0)
+    return;
+
+  int x, y, r, t;
+  blockArea(bx, by, x, y, r, t);
+  for (int c = 0; c < 4; c++) {
+    for (int py = y; py < t; py++) {
+      float* dst = planeRow(c, py);
+      for (int px = x; px < r; px++)
+        dst[px] += _param_constant;
+    }
+  }
+}
 
-          /* is our blurred image already in the cache? */
-        bool cache_read_success = true;
-        if (i_cache->is_active() && i_cache->has_file(hash) ) {
-          DD::Image::ImageCacheReadI* cache_read = i_cache->open( hash );
+/*! Make sure a block is done, reading it from the cache or computing it on
+   this thread if nobody else is. Returns false if that was aborted.
+ */
+bool SimpleBlurCached::computeBlock(int bx, int by)
+{
+  Block& b = _blocks[by * _blocksX + bx];
+  if (b.done)
+    return true;
+
+  Guard guard(b.lock);
+  if (b.done)
+    return true;
+  if (!readBlock(bx, by)) {
+    if (!blurBlock(bx, by))
+      return false;
+    quantizeBlock(bx, by);
+    writeBlock(bx, by);
+  }
+  addConstant(bx, by);
+  b.done = true;
+  return true;
+}
 
-          size_t read_bytes = cache_read->read(vec_dst_image.data(), desired_read_bytes);
+void SimpleBlurCached::blockThreadFunc(unsigned int threadNum, unsigned int, void* data)
+{
+  SimpleBlurCached* op = static_cast<SimpleBlurCached*>(data);
+  const Box& blocks = op->_requestedBlocks;
+  const int count = blocks.w() * blocks.h();
+
+  // Atomic increment, so each requested block is handed out once
+  for (int i = op->_nextBlock++; i < count; i = op->_nextBlock++) {
+    if (op->aborted() || !op->computeBlock(blocks.x() + i % blocks.w(), blocks.y() + i / blocks.w()))
+      return;
+  }
+}
 
-          if (!i_cache->is_read() || read_bytes != desired_read_bytes) {
-            cache_read_success = false;
-          }
+void SimpleBlurCached::engine ( int y, int x, int r,
+                              ChannelMask channels, Row& row )
+{
+  const int width = info_.w();
+  const int height = info_.h();
 
-          cache_read->close();
-        }
-        else {
-          cache_read_success = false;
-        }
-
-        /* did we get the cached blur image or do we need to calculate it? */
-        if (!cache_read_success) {
-
-          /* blur the image, very naively, do not use this code for anything useful! */
-          float blur_sum; int blur_counter;
-          for(int i=0;i<height;i++)
-            for(int j=0;j<width;j++)
-              for(int c=0;c<4;c++){
-                blur_sum = 0; blur_counter = 0;
-                for (int u=std::max(0,i-_param_blur); u<=std::min(height-1,i+_param_blur); u++)
-                  for (int v=std::max(0,j-_param_blur); v<=std::min(width-1,j+_param_blur); v++){
-                    blur_sum += vec_src_image[(u*width + v)*4 + c];
-                    blur_counter++;
-                  }
-                vec_dst_image[(i*width + j)*4 + c] = (blur_counter > 0) ? blur_sum / (float)blur_counter : 0;
-              }
-
-          /* write result to cache */
-          DD::Image::ImageCacheWriteI* cache_write = i_cache->create( hash );
-          size_t desired_write_bytes = (vec_dst_image.size())*sizeof(float);
-
-          cache_write->write(vec_dst_image.data(), desired_write_bytes);
-
-          if (!i_cache->is_written())
-            printf("Error saving blurred image to cache (is written: %d).\n", (int)i_cache->is_written());
-
-          cache_write->close();
-        }
-
-        /* now just going to add the constant to the image */
-        for(size_t i = 0; i<vec_dst_image.size(); i++)
-          vec_dst_image[i] = vec_dst_image[i] + _param_constant;
+  // engine calls are multi-threaded, the first one sets up the blocks under
+  // the lock and hands the requested ones to helper threads
+  if (_isFirstTime) {
+    Guard guard(_lock);
+    if (_isFirstTime) {
 
-      }
-      else {
-        /* return on abort */
-        return;
+      // pad rows to whole cache lines and align the first one
+      _rowStride = (size_t(width) + kRowAlign - 1) / kRowAlign * kRowAlign;
+      _planeStorage.assign(4 * _rowStride * height + kRowAlign, 0.0f);
+      uintptr_t base = reinterpret_cast<uintptr_t>(_planeStorage.data());
+      base = (base + kRowAlign * sizeof(float) - 1) & ~uintptr_t(kRowAlign * sizeof(float) - 1);
+      for (int c = 0; c < 4; c++)
+        _planes[c] = reinterpret_cast<float*>(base) + c * _rowStride * height;
+      _blocks.reset(new Block[_blocksX * _blocksY]);
+
+      if (_requestedBlocks.w() > 0 && _requestedBlocks.h() > 0) {
+        // one less helper than threads, the engine threads work on their
+        // own blocks meanwhile
+        _nextBlock = 0;
+        int n = std::min<int>(Thread::numThreads - 1, _requestedBlocks.w() * _requestedBlocks.h());
+        if (n > 0)
+          Thread::spawn(blockThreadFunc, n, this);
       }
 
       _isFirstTime = false;
@@ -247,21 +581,22 @@ void SimpleBlurCached::engine ( int y, int x, int r,
   engineOut &= rgbaChannels;
 
   if (engineOut) {
-    foreach (z, channels) {
-      float * row1 = row.writable(z);
-
-      int channel_skip = 0;
-      if(z == Chan_Red)
-        channel_skip = 0;
-      else if(z == Chan_Green)
-        channel_skip = 1;
-      else if(z == Chan_Blue)
-        channel_skip = 2;
-      else if(z == Chan_Alpha)
-        channel_skip = 3;
-
-      for(int xx=x; xx<r; xx++)
-        row1[xx] = vec_dst_image[y*4*width + (xx-x)*4 + channel_skip];
+    /* outside the image is black */
+    foreach (z, engineOut)
+      memset(row.writable(z) + x, 0, (r - x) * sizeof(float));
+
+    /* wait for (or compute) just the blocks holding this span */
+    const int sx = std::max(0, x);
+    const int sr = std::min(width, r);
+    if (y < 0 || y >= height || sx >= sr)
+      return;
+    for (int bx = sx / kBlockSize; bx <= (sr - 1) / kBlockSize; bx++) {
+      if (!computeBlock(bx, y / kBlockSize))
+        return;
     }
+
+    /* the planes are laid out like the row, so this is a plain copy */
+    foreach (z, engineOut)
+      memcpy(row.writable(z) + sx, planeRow(rgbaIndex(z), y) + sx, (sr - sx) * sizeof(float));
   }
 }
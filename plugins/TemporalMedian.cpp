@@ -3,8 +3,8 @@
 static const char* const CLASS = "TemporalMedian";
 
 static const char* const HELP =
-  "Removes grain by selecting, for each pixel, the median of this frame, "
-  "the frame before, and the frame after.";
+  "Removes grain by selecting, for each pixel, the median of this frame "
+  "and the frames up to radius before and after it.";
 
 /*! \class TemporalMedian TemporalMedian.C
 
@@ -33,6 +33,9 @@ static const char* const HELP =
    G = min(D,E)
    H = min(F,G)
 
+   With a radius above 1, H is instead the median of the frames T-radius
+   to T+radius, found with a median selection network (see kNetworks).
+
    Now we convert this into a difference from the current frame:
 
    I = H - A
@@ -66,8 +69,177 @@ using namespace DD::Image;
 #include "DDImage/Knobs.h"
 #include "DDImage/Convolve.h"
 #include "DDImage/DDMath.h"
+#include "DDImage/Thread.h"
+#include "DDImage/MemoryHolder.h"
+#include "DDImage/MemHolderFactory.h"
+#include <string.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
 using namespace std;
 
+// Largest radius, and so 2 * kMaxRadius + 1 frames at most:
+static const int kMaxRadius = 4;
+static const int kMaxFrames = 2 * kMaxRadius + 1;
+
+// Pixels put through the network at a time, so each compare-exchange is a
+// short loop over the same few cache lines that the compiler vectorizes:
+static const int kChunk = 64;
+
+/*! Compare-exchange networks that leave the median of 2 * radius + 1 values
+   in the middle, one per radius. They are the optimal sorting networks for
+   3, 5, 7 and 9 inputs with the comparators that cannot reach the middle
+   removed.
+ */
+struct MedianNetwork
+{
+  int count;
+  const unsigned char (*pairs)[2];
+};
+
+static const unsigned char kMedian3[][2] = { {0, 1}, {1, 2}, {0, 1} };
+static const unsigned char kMedian5[][2] = {
+  {0, 1}, {3, 4}, {2, 4}, {2, 3}, {1, 4}, {0, 3}, {0, 2}, {1, 3}, {1, 2}
+};
+static const unsigned char kMedian7[][2] = {
+  {0, 6}, {2, 3}, {4, 5}, {0, 2}, {1, 4}, {3, 6}, {0, 1}, {2, 5}, {3, 4}, {1, 2},
+  {4, 6}, {2, 3}, {4, 5}, {3, 4}
+};
+static const unsigned char kMedian9[][2] = {
+  {0, 3}, {1, 7}, {2, 5}, {4, 8}, {0, 7}, {2, 4}, {3, 8}, {5, 6}, {0, 2}, {1, 3},
+  {4, 5}, {7, 8}, {1, 4}, {3, 6}, {5, 7}, {2, 4}, {3, 5}, {2, 3}, {4, 5}, {3, 4}
+};
+
+static const MedianNetwork kNetworks[kMaxRadius] = {
+  { 3, kMedian3 }, { 9, kMedian5 }, { 14, kMedian7 }, { 20, kMedian9 }
+};
+
+// One row of one input frame, as fetched by FrameRowCache.
+struct FrameRow
+{
+  int x, r;
+  ChannelSet channels;
+  int offset[Chan_Last + 1];     // start of each channel in data, -1 if it is all zero
+  std::vector<float> data;
+
+  // Channel z indexed by x, null if it is all zero.
+  const float* channel(Channel z) const
+  {
+    return offset[z] < 0 ? nullptr : &data[offset[z]] - x;
+  }
+};
+
+/*! Rows of the input frames of one TemporalMedian. Rendering frame N + 1
+   after frame N needs all but one of the frames frame N needed, and finds
+   their rows here instead of asking the input again. Rows are keyed by the
+   hash of the input op, which differs between frames that differ, and the
+   oldest rows are dropped once the cache is over its size. It is a
+   MemoryHolder so Nuke's memory manager counts the rows against the node
+   and can free them when memory runs low.
+ */
+class FrameRowCache : public MemoryHolder
+{
+public:
+  static FrameRowCache* create(Iop* owner)
+  {
+    return MemHolderFactory<FrameRowCache>::create(owner);
+  }
+
+  std::shared_ptr<const FrameRow> find(unsigned long long hash, int y, int x, int r, ChannelMask channels)
+  {
+    Guard guard(_lock);
+    std::map<Key, Entry>::iterator it = _rows.find(Key(hash, y));
+    if (it == _rows.end())
+      return std::shared_ptr<const FrameRow>();
+    const FrameRow& row = *it->second.row;
+    if (row.x > x || row.r < r)
+      return std::shared_ptr<const FrameRow>();
+    foreach (z, channels) {
+      if (!(row.channels & z))
+        return std::shared_ptr<const FrameRow>();
+    }
+    _order.splice(_order.begin(), _order, it->second.used);
+    return it->second.row;
+  }
+
+  void insert(unsigned long long hash, int y, const std::shared_ptr<const FrameRow>& row)
+  {
+    Guard guard(_lock);
+    const Key key(hash, y);
+    std::map<Key, Entry>::iterator it = _rows.find(key);
+    if (it != _rows.end()) {
+      _bytes -= it->second.row->data.size() * sizeof(float);
+      _order.erase(it->second.used);
+      _rows.erase(it);
+    }
+    _order.push_front(key);
+    Entry entry = { row, _order.begin() };
+    _rows[key] = entry;
+    _bytes += row->data.size() * sizeof(float);
+
+    while (_bytes > kMaxBytes && _order.size() > 1)
+      dropOldest();
+  }
+
+  // Implementation of memoryFree from MemoryHolder. Drops the oldest rows until
+  // amount bytes have been freed, or every row if amount is 0.
+  bool memoryFree(size_t amount) override
+  {
+    // trylock must be used as this may be called from inside an
+    // allocation in insert()
+    if (!_lock.trylock())
+      return false;
+    const size_t before = _bytes;
+    while (!_order.empty() && (amount == 0 || before - _bytes < amount))
+      dropOldest();
+    _lock.unlock();
+    return _bytes < before;
+  }
+
+  // Implementation of memoryInfo from MemoryHolder
+  void memoryInfo(Memory::MemoryInfoArray& output, const void* restrict_to) const override
+  {
+    if (restrict_to && _owner->node() != (const Node*)restrict_to)
+      return;
+    output.push_back(Memory::MemoryInfo(_owner, _bytes));
+  }
+
+  // Implementation of memoryWeight from MemoryHolder. The rows can always be
+  // fetched from the input again.
+  int memoryWeight() const override { return 100; }
+
+protected:
+  // Don't call this directly; use FrameRowCache::create() instead, to register
+  // the cache with Nuke's memory manager.
+  FrameRowCache(Iop* owner) : _owner(owner), _bytes(0) {}
+
+private:
+  static const size_t kMaxBytes = size_t(256) << 20;
+
+  typedef std::pair<unsigned long long, int> Key;
+  struct Entry
+  {
+    std::shared_ptr<const FrameRow> row;
+    std::list<Key>::iterator used;
+  };
+
+  // Drop the least recently used row. Called with _lock held.
+  void dropOldest()
+  {
+    std::map<Key, Entry>::iterator oldest = _rows.find(_order.back());
+    _bytes -= oldest->second.row->data.size() * sizeof(float);
+    _rows.erase(oldest);
+    _order.pop_back();
+  }
+
+  Iop* _owner;
+  Lock _lock;
+  std::map<Key, Entry> _rows;
+  std::list<Key> _order;         // most recently used first
+  size_t _bytes;
+};
+
 class TemporalMedian : public Iop
 {
 public:
@@ -77,8 +249,8 @@ public:
   //
   int maximum_inputs() const override { return 1; }
   int minimum_inputs() const override { return 1; }
-  // Tell it that the single input is now 3 inputs
-  int split_input(int n) const override { return 3; }
+  // Tell it that the single input is now 2 * radius + 1 inputs
+  int split_input(int) const override { return 2 * clampedRadius() + 1; }
   // Routine to return the frame attached to each input
   const OutputContext& inputContext(int, int, OutputContext&) const override;
 
@@ -87,12 +259,16 @@ public:
   TemporalMedian (Node* node) : Iop (node)
   {
     core[0] = core[1] = core[2] = core[3] = 0.05f;
+    radius = 1;
+    _rowCache = FrameRowCache::create(this);
   } // TemporalMedian
 
   //! Destructor.
 
   ~TemporalMedian () override
-  { } // ~TemporalMedian
+  {
+    delete _rowCache;
+  } // ~TemporalMedian
 
   // The default _validate() and _request work good for this
 
@@ -108,6 +284,9 @@ public:
 
   void knobs ( Knob_Callback f ) override
   {
+    Int_knob(f, &radius, IRange(1, kMaxRadius), "radius");
+    Tooltip(f, "Number of frames before and after this one to take the "
+               "median of. 1 is three frames, 4 is nine.");
     AColor_knob(f, core, "core");
     Tooltip(f, "Differences greater than this are left unchanged, as they "
                "probably indicate something other than film grain.");
@@ -131,21 +310,25 @@ protected:
   // Variables that are attached to knobs.
   //
   float core[4];
+  int radius;
+
+  int clampedRadius() const { return std::max(1, std::min(radius, kMaxRadius)); }
+
+  // Rows of the input frames read by this node.
+  FrameRowCache* _rowCache;
+
+  // Row y of the frame of input n, from _rowCache if it is there.
+  std::shared_ptr<const FrameRow> getFrameRow(int n, int y, int x, int r, ChannelMask channels);
 }; // class TemporalMedian
 
-// The time for image input n :-
+// The time for image input n :- this frame, then the frame before and the
+// frame after at each distance in turn
 const OutputContext& TemporalMedian::inputContext(int i, int n, OutputContext& context) const
 {
   context = outputContext();
-  switch (n) {
-    case 0:
-      break;
-    case 1:
-      context.setFrame(context.frame() - 1);
-      break;
-    case 2:
-      context.setFrame(context.frame() + 1);
-      break;
+  if (n > 0) {
+    const int distance = (n + 1) / 2;
+    context.setFrame(context.frame() + (n & 1 ? -distance : distance));
   }
   return context;
 }
@@ -165,6 +348,40 @@ static Iop* TemporalMedianCreate(Node* node)
 const Iop::Description TemporalMedian::description ( CLASS, "Filter/TemporalMedian",
                                                      TemporalMedianCreate );
 
+// Row y of input n between x and r, from the row cache or else read from the input.
+std::shared_ptr<const FrameRow> TemporalMedian::getFrameRow(int n, int y, int x, int r, ChannelMask channels)
+{
+  Iop& in = *input(n);
+  const unsigned long long hash = in.hash().value();
+  std::shared_ptr<const FrameRow> cached = _rowCache->find(hash, y, x, r, channels);
+  if (cached)
+    return cached;
+
+  Row inrow(x, r);
+  inrow.get(in, y, x, r, channels);
+
+  std::shared_ptr<FrameRow> row(new FrameRow);
+  row->x = x;
+  row->r = r;
+  row->channels = channels;
+  int size = 0;
+  foreach ( z, channels ) {
+    row->offset[z] = inrow.is_zero(z) ? -1 : size;
+    if (row->offset[z] >= 0)
+      size += r - x;
+  }
+  row->data.resize(size);
+  foreach ( z, channels ) {
+    if (row->offset[z] >= 0)
+      memcpy(&row->data[row->offset[z]], inrow[z] + x, (r - x) * sizeof(float));
+  }
+
+  // an aborted row may be incomplete, so it is used but not kept
+  if (!aborted())
+    _rowCache->insert(hash, y, row);
+  return row;
+}
+
 /*! For each line in the area passed to request(), this will be called. It must
    calculate the image data for a region at vertical position y, and between
    horizontal positions x and r, and write it to the passed row
@@ -175,39 +392,59 @@ const Iop::Description TemporalMedian::description ( CLASS, "Filter/TemporalMedi
 void TemporalMedian::engine ( int y, int x, int r,
                               ChannelMask channels, Row& row )
 {
-  row.get(input0(), y, x, r, channels);
-  Row prevrow(x, r);
-  Row nextrow(x, r);
-  prevrow.get(input1(), y, x, r, channels);
-  nextrow.get(*input(2), y, x, r, channels);
+  const int frameRadius = clampedRadius();
+  const int frames = 2 * frameRadius + 1;
+  const MedianNetwork& network = kNetworks[frameRadius - 1];
+
+  std::shared_ptr<const FrameRow> inrows[kMaxFrames];
+  for ( int n = 0; n < frames; n++ ) {
+    inrows[n] = getFrameRow(n, y, x, r, channels);
+    if ( aborted() )
+      return;
+  }
+
+  std::vector<float> zeros(r - x, 0.0f);
+  float buffer[kMaxFrames][kChunk];
 
   foreach ( z, channels ) {
-    const float* PREV = prevrow[z] + x;
-    const float* CUR  = row[z] + x;
-    const float* NEXT = nextrow[z] + x;
-    float* outptr = row.writable(z) + x;
-    const float* END = outptr + (r - x);
+    const float* IN[kMaxFrames];
+    for ( int n = 0; n < frames; n++ ) {
+      IN[n] = inrows[n]->channel(z);
+      if ( !IN[n] )
+        IN[n] = &zeros[0] - x;
+    }
+    float* outptr = row.writable(z);
     const float core = this->core[z <= Chan_Alpha ? z - 1 : 0];
 
-    while (outptr < END) {
+    for ( int X = x; X < r; X += kChunk ) {
+      const int count = std::min(kChunk, r - X);
+      for ( int n = 0; n < frames; n++ )
+        memcpy(buffer[n], IN[n] + X, count * sizeof(float));
+
+      // branch-free compare-exchanges, each one a loop over the chunk
+      for ( int c = 0; c < network.count; c++ ) {
+        float* lo = buffer[network.pairs[c][0]];
+        float* hi = buffer[network.pairs[c][1]];
+        for ( int i = 0; i < count; i++ ) {
+          const float a = lo[i];
+          const float b = hi[i];
+          lo[i] = MIN(a, b);
+          hi[i] = MAX(a, b);
+        }
+      }
+
       // We use single letter variable names here to correspond with the
       // text description of the algorithm above.
-
-      float A = *CUR++;
-      float B = *PREV++;
-      float C = *NEXT++;
-
-      float D = MAX(A, C);
-      float E = MAX(B, C);
-      float F = MAX(A, B);
-
-      float G = MIN(D, E);
-      float H = MIN(F, G);
-      float I = H - A;
-
-      float J =  (I > core) ? MAX(2 * core - I, 0.0f) : I;
-      float K =  (J < -core) ? MIN(-2 * core - J, 0.0f) : J;
-      *outptr++ = K + A;
+      const float* CUR = IN[0] + X;
+      const float* H = buffer[frameRadius];
+      for ( int i = 0; i < count; i++ ) {
+        float A = CUR[i];
+        float I = H[i] - A;
+
+        float J =  (I > core) ? MAX(2 * core - I, 0.0f) : I;
+        float K =  (J < -core) ? MIN(-2 * core - J, 0.0f) : J;
+        outptr[X + i] = K + A;
+      }
     }
   }
 } // TemporalMedian::engine
@@ -14,9 +14,14 @@
 #include "DDImage/MemoryHolder.h"
 #include "DDImage/MemHolderFactory.h"
 #include "DDImage/LUT.h"
+#include "DDImage/Thread.h"
 #include "DPXimage.h"
+#include "DpxUnpack.h"
 
 #include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <sstream>
 #include <iomanip>
 #include <limits>
@@ -59,6 +64,9 @@ typedef Foundry::Base::ThreadLocalStorage<Count> ThreadLocalCount;
 
 #define kMaxDPXElements 8
 
+// The preload of the requested lines reads this many lines of an element at a time.
+#define kPreloadChunkLines 64
+
 // FileBuffer to hold data from the file for up to kMaxDPXElements DPX elements.
 // Derives from MemoryHolder to provide usage information to Nuke's memory manager.
 class FileBuffer : public MemoryHolder
@@ -109,6 +117,71 @@ public:
     return _buffer[index];
   }
 
+  // Set the number of preload chunks for the given element, none of them read yet.
+  void resetChunks(int index, int count)
+  {
+    mFnAssert(index >= 0 && index < kMaxDPXElements);
+    _chunkReady[index].reset(count > 0 ? new std::atomic<bool>[count] : nullptr);
+    for (int i = 0; i < count; i++)
+      _chunkReady[index][i] = false;
+    _chunkCount[index] = count;
+  }
+
+  // Get the number of preload chunks for the given element.
+  int getChunkCount(int index) const
+  {
+    mFnAssert(index >= 0 && index < kMaxDPXElements);
+    return _chunkCount[index];
+  }
+
+  // Flag that a chunk of lines of the given element has been read into the buffer, and
+  // wake any threads waiting for it.
+  void setChunkReady(int index, int chunk)
+  {
+    mFnAssert(index >= 0 && index < kMaxDPXElements);
+    mFnAssert(chunk >= 0 && chunk < _chunkCount[index]);
+    _chunkSignal.lock();
+    _chunkReady[index][chunk].store(true, std::memory_order_release);
+    _chunkSignal.signal();
+    _chunkSignal.unlock();
+  }
+
+  // Flag whether a preload is filling the buffer. Clearing it wakes any threads waiting for
+  // chunks that will now never arrive.
+  void setPreloading(bool preloading)
+  {
+    _chunkSignal.lock();
+    _preloading = preloading;
+    _chunkSignal.signal();
+    _chunkSignal.unlock();
+  }
+
+  // Whether the chunk holding the given line (counted from getYMin()) of the given element
+  // has been read into the buffer.
+  bool lineReady(int index, int line) const
+  {
+    mFnAssert(index >= 0 && index < kMaxDPXElements);
+    const int chunk = line / kPreloadChunkLines;
+    return line >= 0 && chunk < _chunkCount[index] && _chunkReady[index][chunk].load(std::memory_order_acquire);
+  }
+
+  // Wait until the chunk holding the given line of the given element has been read into the
+  // buffer. Returns false, and the line must be read from the file instead, if the line is not
+  // part of the preload or the preload stopped before reaching it.
+  bool waitForLine(int index, int line)
+  {
+    if (lineReady(index, line))
+      return true;
+    if (line < 0 || line / kPreloadChunkLines >= _chunkCount[index])
+      return false;
+
+    _chunkSignal.lock();
+    while (_preloading && !lineReady(index, line))
+      _chunkSignal.wait();
+    _chunkSignal.unlock();
+    return lineReady(index, line);
+  }
+
   // Get the buffer size for the given element.
   size_t getBufferSize(int index) const
   {
@@ -230,12 +303,14 @@ protected:
   // the cache with Nuke's memory manager.
   FileBuffer(Iop* iopOwner)
     : _iopOwner(iopOwner)
+    , _preloading(false)
     , _locked(false)
   {
     // Initialise file buffers
     for (unsigned int i = 0; i < kMaxDPXElements; i++) {
       _buffer[i] = nullptr;
       _bufferSize[i] = 0;
+      _chunkCount[i] = 0;
     }
   }
 
@@ -259,12 +334,17 @@ protected:
       wasCleared = true;
     }
     _bufferSize[index] = 0;
+    resetChunks(index, 0);
     return wasCleared;
   }
 
 private:
   uchar* _buffer[kMaxDPXElements];  //!< Internal file buffer to hold up to kMaxDPXElements DPX elements.
   size_t _bufferSize[kMaxDPXElements];  //!< The current size of the file buffer for each of the kMaxDPXElements DPX elements.
+  std::unique_ptr<std::atomic<bool>[]> _chunkReady[kMaxDPXElements];  //!< Which chunks of kPreloadChunkLines lines have been read, for each element.
+  int _chunkCount[kMaxDPXElements];  //!< The number of preload chunks for each element.
+  SignalLock _chunkSignal;  //!< Signalled whenever a chunk is read or the preload stops.
+  bool _preloading;  //!< Whether a preload is still filling the buffer.
 
   int _yMin;  //!< The y-coordinate of the first line stored in the buffer.
   int _yMax;  //!< The y-coordinate of the last line stored in the buffer.
@@ -306,6 +386,7 @@ class dpxReader : public FileReader
 
   // this is the parts of the header we keep:
   bool _flipEndian;
+  const DpxUnpackers* _unpack; //!< The unpackers for this CPU.
   bool ycbcr_hack;
   unsigned orientation;
   unsigned width;
@@ -336,6 +417,8 @@ class dpxReader : public FileReader
   // Internal file buffer controls. This buffer is used to store the entire contents of the file when
   // reading full frames (where possible) has been requested on the command line.
   FileBuffer* _requestedLinesPreloadBuffer;
+  // Set to make the preload thread stop before its next chunk.
+  std::atomic<bool> _stopPreload;
 
   bool testFileBuffer() const
   {
@@ -346,8 +429,14 @@ class dpxReader : public FileReader
   // Whether we need to invert y when reading from the file.
   bool invertY() const { return !(orientation & 2); }
 
+  // Allocate the file buffer for the requested lines and start reading them into it a chunk
+  // at a time on a background thread. get_line_from_file() waits for a line's chunk and uses
+  // it as soon as it has been read, so open() no longer blocks on the whole frame.
   void readAllLines()
   {
+    // A preload started by an earlier open() must not write into buffers we are resizing.
+    stopPreload();
+
     // If we have a file buffer, and it hasn't been locked due to low memory, allocate
     // space for reading the requested lines into.
     if (testFileBuffer()) {
@@ -365,6 +454,9 @@ class dpxReader : public FileReader
 
       // Test again to make sure no memory is being freed.
       if (!_requestedLinesPreloadBuffer->locked()) {
+        for (unsigned i = 0; i < kMaxDPXElements; i++)
+          _requestedLinesPreloadBuffer->resetChunks(i, 0);
+
         for (unsigned i = 0; i < kMaxDPXElements; i++) {
           if (element[i].channels & remaining) {
 
@@ -376,19 +468,77 @@ class dpxReader : public FileReader
             // This will reallocate the buffer if the size has changed.
             _requestedLinesPreloadBuffer->resizeBuffer(i, bufferSize);
             _requestedLinesPreloadBuffer->setYRange(yMin, yMax);
-
-            // Read all requested lines from the file into our internal buffer.
-            read((void *)_requestedLinesPreloadBuffer->getBuffer(i), element[i].dataOffset + yMin * element[i].bytes, static_cast<unsigned int>(bufferSize));
+            _requestedLinesPreloadBuffer->resetChunks(i, (nLines + kPreloadChunkLines - 1) / kPreloadChunkLines);
 
             remaining -= element[i].channels;
             if (!remaining)
               break;
           }
         }
+
+        // Read the requested lines in the background, or here if there is only one thread.
+        _requestedLinesPreloadBuffer->setPreloading(true);
+        if (Thread::numThreads > 1)
+          Thread::spawn(preloadThreadFunc, 1, this);
+        else
+          preloadChunks();
       }
     }
   }
 
+  static void preloadThreadFunc(unsigned, unsigned, void* data)
+  {
+    static_cast<dpxReader*>(data)->preloadChunks();
+  }
+
+  // Read the requested lines into the file buffer a chunk at a time, flagging each chunk as
+  // ready once it is in. Every element's chunk of a band of lines is read before the next
+  // band, so the rows waiting on the first band can decode as soon as possible.
+  void preloadChunks()
+  {
+    readChunks();
+    _requestedLinesPreloadBuffer->setPreloading(false);
+  }
+
+  void readChunks()
+  {
+    int numChunks = 0;
+    for (unsigned i = 0; i < kMaxDPXElements; i++)
+      numChunks = std::max(numChunks, _requestedLinesPreloadBuffer->getChunkCount(i));
+
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+      for (unsigned i = 0; i < kMaxDPXElements; i++) {
+        if (chunk >= _requestedLinesPreloadBuffer->getChunkCount(i))
+          continue;
+        if (_stopPreload)
+          return;
+
+        // Make sure the internal file buffer won't be freed while we are reading into it,
+        // and give up if it has been freed since the last chunk.
+        FileBufferGuard guard(_requestedLinesPreloadBuffer);
+        if (_requestedLinesPreloadBuffer->locked())
+          return;
+
+        const int yMin = _requestedLinesPreloadBuffer->getYMin();
+        const int nLines = _requestedLinesPreloadBuffer->getYMax() - yMin + 1;
+        const int firstLine = chunk * kPreloadChunkLines;
+        const int chunkLines = std::min(kPreloadChunkLines, nLines - firstLine);
+        read((void *)(_requestedLinesPreloadBuffer->getBuffer(i) + size_t(firstLine) * element[i].bytes),
+             element[i].dataOffset + (yMin + firstLine) * element[i].bytes,
+             static_cast<unsigned int>(size_t(chunkLines) * element[i].bytes));
+        _requestedLinesPreloadBuffer->setChunkReady(i, chunk);
+      }
+    }
+  }
+
+  // Stop any preload that is running and wait for its thread to finish.
+  void stopPreload()
+  {
+    _stopPreload = true;
+    Thread::wait(this);
+    _stopPreload = false;
+  }
+
 public:
 
   const MetaData::Bundle& fetchMetaData(const char* key) override
@@ -399,6 +549,8 @@ public:
   dpxReader(Read* iop, int fd, const unsigned char* block, int len)
     : FileReader(iop, fd, block, len)
   {
+    _unpack = &SelectDpxUnpackers();
+    _stopPreload = false;
     _readAllLines = readAllLinesRequested();
     if (_readAllLines) {
       // Use an internal file buffer to cache the requested lines from the file
@@ -878,6 +1030,7 @@ public:
 
   ~dpxReader() override
   {
+    stopPreload();
     delete _requestedLinesPreloadBuffer;
   }
 
@@ -1005,8 +1158,8 @@ public:
     from_float(Chan_Blue, B + x, B + x, alpha ? row[Chan_Alpha] + x : nullptr, r - x);
   }
 
-  // Read a line from the file, or from our internal buffer for the file, if the latter exists
-  // and is unlocked.
+  // Read a line from the file, or from our internal buffer for the file, if the latter exists,
+  // is unlocked and the preload has not stopped before reaching the line.
   void get_line_from_file(void* destination,
                           unsigned int elementIndex,
                           unsigned int dataOffsetInFile,
@@ -1025,10 +1178,12 @@ public:
         mFnAssertMsg(y >= _requestedLinesPreloadBuffer->getYMin() && y <= _requestedLinesPreloadBuffer->getYMax(),
                      "dpxReader: out-of-bounds access to internal file buffer.");
 
-        // Read the line from our internal frame buffer.
+        // Read the line from our internal frame buffer once its chunk has been preloaded.
         const int lineOffsetInBuffer= y - _requestedLinesPreloadBuffer->getYMin();
-        memcpy(destination, _requestedLinesPreloadBuffer->getBuffer(elementIndex) + lineOffsetInBuffer * lineSize, bytesToRead);
-        return;
+        if (_requestedLinesPreloadBuffer->waitForLine(elementIndex, lineOffsetInBuffer)) {
+          memcpy(destination, _requestedLinesPreloadBuffer->getBuffer(elementIndex) + lineOffsetInBuffer * lineSize, bytesToRead);
+          return;
+        }
       }
     }
 
@@ -1136,11 +1291,13 @@ public:
         unsigned x;
         ARRAY(U32, src, n);
         get_line_from_file(src, index, e.dataOffset, e.bytes, y, e.bytes);
-        if (_flipEndian)
-          flip(src, n);
         switch (e.packing) {
           case 0:
-            for (x = 0; x < width * e.components; x++) {
+            // the unpackers swap each word as they unpack it
+            x = _unpack->packed(src, n, 10, _flipEndian, false, false, 0, width * e.components, buf);
+            if (_flipEndian)
+              flip(src + x * 10 / 32, n - x * 10 / 32);
+            for (; x < width * e.components; x++) {
               unsigned a = (x * 10) / 32;
               unsigned b = (x * 10) % 32;
               if (b > 22)
@@ -1149,20 +1306,30 @@ public:
                 buf[x] = (src[a] >> b) & 0x3ff;
             }
             break;
-          case 1:
-            for (x = 0; x < n; x++) {
+          case 1: {
+            static const int shifts[3] = { 22, 12, 2 };
+            x = _unpack->filled10(src, n, shifts, _flipEndian, false, false, 0, buf);
+            if (_flipEndian)
+              flip(src + x, n - x);
+            for (; x < n; x++) {
               buf[3 * x + 0] = (src[x] >> 22) & 0x3ff;
               buf[3 * x + 1] = (src[x] >> 12) & 0x3ff;
               buf[3 * x + 2] = (src[x] >> 02) & 0x3ff;
             }
             break;
-          case 2:
-            for (x = 0; x < n; x++) {
+          }
+          case 2: {
+            static const int shifts[3] = { 20, 10, 0 };
+            x = _unpack->filled10(src, n, shifts, _flipEndian, false, false, 0, buf);
+            if (_flipEndian)
+              flip(src + x, n - x);
+            for (; x < n; x++) {
               buf[3 * x + 0] = (src[x] >> 20) & 0x3ff;
               buf[3 * x + 1] = (src[x] >> 10) & 0x3ff;
               buf[3 * x + 2] = (src[x] >> 00) & 0x3ff;
             }
             break;
+          }
         }
         break;
       }
@@ -1172,9 +1339,10 @@ public:
             unsigned n = (e.bytes + 3) / 4;
             ARRAY(U32, src, n);
             get_line_from_file(src, index, e.dataOffset, e.bytes, y, e.bytes);
+            unsigned x = _unpack->packed(src, n, 12, _flipEndian, false, false, 0, width * e.components, buf);
             if (_flipEndian)
-              flip(src, n);
-            for (unsigned x = 0; x < width * e.components; x++) {
+              flip(src + x * 12 / 32, n - x * 12 / 32);
+            for (; x < width * e.components; x++) {
               unsigned a = (x * 12) / 32;
               unsigned b = (x * 12) % 32;
               if (b > 20)
@@ -1187,18 +1355,20 @@ public:
           case 1: {
             unsigned n = width * e.components;
             get_line_from_file(buf, index, e.dataOffset, e.bytes, y, n * 2);
+            unsigned x = _unpack->filled12(buf, n, 4, _flipEndian, false, buf);
             if (_flipEndian)
-              flip(buf, n);
-            for (unsigned x = 0; x < n; x++)
+              flip(buf + x, n - x);
+            for (; x < n; x++)
               buf[x] >>= 4;
             break;
           }
           case 2: {
             unsigned n = width * e.components;
             get_line_from_file(buf, index, e.dataOffset, e.bytes, y, n * 2);
+            unsigned x = _unpack->filled12(buf, n, 0, _flipEndian, false, buf);
             if (_flipEndian)
-              flip(buf, n);
-            for (unsigned x = 0; x < n; x++)
+              flip(buf + x, n - x);
+            for (; x < n; x++)
               buf[x] &= 0xfff;
             break;
           }
@@ -1345,6 +1515,13 @@ public:
   // Also rescales floating point output to the range [0, 1].
   #define SCALE_BITS_TO_DEST_RANGE
 
+  // The same choice for the unpackers, which take it as an argument.
+  #ifdef SCALE_BITS_TO_DEST_RANGE
+  static constexpr bool kScaleBitsToDestRange = true;
+  #else
+  static constexpr bool kScaleBitsToDestRange = false;
+  #endif
+
   //! Finds the first dpx element which has channels matching the requested channels,
   //! returning the index of that element, or -1 if no match is found. If @a matchRGBandRGBA
   //! is true then RGBA and RGB are considered a match (with the alpha channel in either
@@ -1900,22 +2077,25 @@ public:
       U16* destBuffer = &(image.writableAt<U16>(0, yImage, 0)); // Hard-coded to U16 destination.
       const U32* srcWordAddr = reinterpret_cast<const U32*>(static_cast<const char*>(srcBuffer) + e.dataOffset + y * e.bytes);
 
-      // #rick: Try to rewrite this to avoid the local buffer. It'll be fiddly because channels can straddle 32 bit words,
-      //        which might need flipping. The problem is to avoid flipping any words twice - I think this can only be
-      //        done with an if statement.
+      int numComponentsPerRow = width * e.components;
+
+      // The vector unpacker swaps, unpacks and adds alpha for as many whole blocks as it can, straight from the
+      // file buffer. Only the words holding the rest of the row are copied into the local buffer and flipped.
+      const int done = _unpack->packed(srcWordAddr, e.bytes / 4, e.bits, EndianFlip, kScaleBitsToDestRange, RgbToRgba, alphaValue, numComponentsPerRow, destBuffer);
+      destBuffer += RgbToRgba ? done / 3 * 4 : done;
 
       int numWords = (e.bytes + 3) / 4;
+      int firstWord = done * e.bits / 32;
       ARRAY(U32, rawBuffer, numWords);
 
-      memcpy(rawBuffer, srcWordAddr, e.bytes);
+      memcpy(rawBuffer + firstWord, srcWordAddr + firstWord, e.bytes - firstWord * 4);
       if (EndianFlip)
-        flip(rawBuffer, numWords);
+        flip(rawBuffer + firstWord, numWords - firstWord);
 
       // The first bit, within a 32 bit word, at which the component must straddle the boundary with the next 32 bit word.
       int firstStraddlingBit = 32 - e.bits;
 
-      int numComponentsPerRow = width * e.components;
-      for (int componentCount = 0; componentCount < numComponentsPerRow; ++componentCount) {
+      for (int componentCount = done; componentCount < numComponentsPerRow; ++componentCount) {
 
         int startBitCount = componentCount * e.bits;
         int relatativeStartBitCount = startBitCount % 32; // Bit index from the start of the current 32 bit word.
@@ -2014,7 +2194,13 @@ public:
 
       U32* destBuffer = &(image.writableAt<U32>(0, yImage, 0));
 
-      for (int x = 0; x < width; x++)
+      // The vector unpacker does as many whole blocks of words as it can.
+      const int shifts[3] = { bitShift1, bitShift2, bitShift3 };
+      const int done = _unpack->filled10Rev(srcWordAddr, width, shifts, EndianFlip, U32(alphaValue) << 30, destBuffer);
+      srcWordAddr += done;
+      destBuffer += done;
+
+      for (int x = done; x < width; x++)
       {
         U32 srcWord = *srcWordAddr++;
 
@@ -2121,7 +2307,13 @@ public:
       const int numComponentsPerRow = width * e.components;
       const int numFilledWords = numComponentsPerRow / 3;   // 10 bit filled stores 3 components per word, plus any remainder in the last word.
 
-      for (int filledWordCount = 0; filledWordCount < numFilledWords; ++filledWordCount) {
+      // The vector unpacker does as many whole blocks of words as it can.
+      const int shifts[3] = { bitShift1, bitShift2, bitShift3 };
+      const int done = _unpack->filled10(srcWordAddr, numFilledWords, shifts, EndianFlip, kScaleBitsToDestRange, RgbToRgba, alphaValue, destBuffer);
+      srcWordAddr += done;
+      destBuffer += done * (RgbToRgba ? 4 : 3);
+
+      for (int filledWordCount = done; filledWordCount < numFilledWords; ++filledWordCount) {
         U32 srcWord = *srcWordAddr++;
 
         if (EndianFlip)
@@ -2273,7 +2465,12 @@ public:
 
       if (RgbToRgba) {
 
-        for (unsigned int column = 0; column < width; ++column) {
+        // The vector unpacker does as many whole blocks of pixels as it can.
+        const int done = _unpack->filled12Rgba(srcHalfWordAddr, width, bitShift, EndianFlip, kScaleBitsToDestRange, alphaValue, destBuffer);
+        srcHalfWordAddr += 3 * done;
+        destBuffer += 4 * done;
+
+        for (unsigned int column = done; column < width; ++column) {
           // Decode the three RGB channels from the source.
           U16 srcHalfWord = *srcHalfWordAddr++;
           if (EndianFlip)
@@ -2310,7 +2507,11 @@ public:
 
         int numComponentsPerRow = width * e.components;
 
-        for (int component = 0; component < numComponentsPerRow; ++component) {
+        const int done = _unpack->filled12(srcHalfWordAddr, numComponentsPerRow, bitShift, EndianFlip, kScaleBitsToDestRange, destBuffer);
+        srcHalfWordAddr += done;
+        destBuffer += done;
+
+        for (int component = done; component < numComponentsPerRow; ++component) {
           U16 srcHalfWord = *srcHalfWordAddr++;
           if (EndianFlip)
             srcHalfWord = (srcHalfWord >> 8) | (srcHalfWord << 8);
@@ -0,0 +1,128 @@
+// Copyright (c) 2009 The Foundry Visionmongers Ltd.  All Rights Reserved.
+
+// ConvolveTapsTest.cpp
+
+// Standalone check of the row kernels in ConvolveTaps.h against the plain
+// loop they replace, one tap per pass over the row. Every kernel the
+// processor runs is tried over random taps, spans and misalignments of the
+// input and output rows. It is not built by compile.sh. Build and run it with:
+//
+//   g++ -O2 -std=c++17 -o ConvolveTapsTest plugins/tests/ConvolveTapsTest.cpp && ./ConvolveTapsTest
+//
+// It exits with 1 if any kernel is further from the loop than the rounding
+// of a different order of adds allows, or writes outside its span.
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "../ConvolveTaps.h"
+
+// The reference: each tap added into the whole span in turn.
+static void referenceTaps(float* outptr, const float* inptr, const FilterTap* taps, int count, int start, int end)
+{
+  for (int t = 0; t < count; ++t) {
+    for (int xx = start; xx < end; ++xx) {
+      outptr[xx] += inptr[taps[t].offset + xx] * taps[t].value;
+    }
+  }
+}
+
+struct TapKernel
+{
+  const char* name;
+  ConvolveTapsFn fn;
+};
+
+// FnConvolve adds one tap, it is run once per tap to fit the same signature.
+static void singleTaps(float* outptr, const float* inptr, const FilterTap* taps, int count, int start, int end)
+{
+  for (int t = 0; t < count; ++t)
+    FnConvolve(outptr, inptr + taps[t].offset, taps[t].value, start, end);
+}
+
+int main()
+{
+  std::vector<TapKernel> kernels;
+  kernels.push_back({ "single", singleTaps });
+  kernels.push_back({ "scalar", FnConvolveTapsScalar });
+#ifndef FN_PROCESSOR_PPC
+  kernels.push_back({ "sse", FnConvolveTapsSSE });
+#endif
+#ifdef CONVOLVE_WIDE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    kernels.push_back({ "avx2", FnConvolveTapsAVX2 });
+  if (__builtin_cpu_supports("avx512f"))
+    kernels.push_back({ "avx512", FnConvolveTapsAVX512 });
+#endif
+  const char* selected = "";
+  SelectConvolveTaps(&selected);
+  printf("selected: %s\n", selected);
+
+  static const float kGuard = 12345.0f;
+  static const int kPad = 16;
+  std::mt19937 rng(9);
+  std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+  int failures = 0;
+  double maxError = 0;
+  for (int iteration = 0; iteration < 20000; iteration++) {
+    const int count = rng() % 40;
+    const int start = rng() % 20;
+    const int end = start + int(rng() % 300);
+    const int reach = 1 + rng() % 64;
+    const int outShift = rng() % kPad, inShift = rng() % kPad;
+
+    std::vector<FilterTap> taps(count);
+    for (FilterTap& tap : taps) {
+      tap.offset = rng() % reach;
+      tap.value = value(rng);
+    }
+    std::vector<float> inBuffer(end + reach + 2 * kPad);
+    for (float& v : inBuffer)
+      v = value(rng) * 4;
+    const float* inptr = inBuffer.data() + inShift;
+
+    std::vector<float> initial(end + 2 * kPad);
+    for (float& v : initial)
+      v = value(rng);
+    std::vector<float> expect(initial);
+    referenceTaps(expect.data() + kPad, inptr, taps.data(), count, start, end);
+
+    for (const TapKernel& kernel : kernels) {
+      // the row starts at a random float inside the padding, with guard
+      // values on both sides of the span
+      std::vector<float> got(end + 3 * kPad, kGuard);
+      float* outptr = got.data() + outShift;
+      std::copy(initial.begin() + kPad + start, initial.begin() + kPad + end, outptr + start);
+      kernel.fn(outptr, inptr, taps.data(), count, start, end);
+
+      bool bad = false;
+      for (int i = 0; i < int(got.size()); i++) {
+        const int x = i - outShift;
+        if (x >= start && x < end) {
+          // the adds may be in any order, so allow their rounding
+          double scale = fabs(initial[kPad + x]);
+          for (const FilterTap& tap : taps)
+            scale += fabs(inptr[tap.offset + x] * tap.value);
+          const double error = fabs(double(got[i]) - expect[kPad + x]);
+          maxError = std::max(maxError, error / std::max(scale, 1e-30));
+          if (error > 1e-6 * (count + 1) * scale)
+            bad = true;
+        }
+        else if (got[i] != kGuard) {
+          bad = true;
+        }
+      }
+      if (bad) {
+        printf("%s differs: taps %d span %d-%d reach %d shifts %d %d\n",
+               kernel.name, count, start, end, reach, outShift, inShift);
+        failures++;
+      }
+    }
+  }
+  printf("largest error %.2g of the sum of magnitudes, %d failures\n", maxError, failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,228 @@
+// Copyright (c) 2009 The Foundry Visionmongers Ltd.  All Rights Reserved.
+
+// DpxUnpackTest.cpp
+
+// Standalone bit-exact check of the SSSE3 and AVX2 unpackers in DpxUnpack.h
+// against scalar versions of dpxReader's filled and packed 10 and 12 bit
+// decoding, plus timings of the filled and packed 10 bit unpack of a
+// 4096 x 2160 frame. It is not built by compile.sh. Build and run it with:
+//
+//   g++ -O2 -std=c++17 -o DpxUnpackTest plugins/tests/DpxUnpackTest.cpp && ./DpxUnpackTest
+//
+// It exits with 1 if any kernel differs from the scalar decode.
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+// as in DPXimage.h
+typedef uint8_t U8;
+typedef uint16_t U16;
+typedef uint32_t U32;
+
+#include "../DpxUnpack.h"
+
+static U32 byteSwap(U32 w) { return (w >> 24) | (w >> 8 & 0xff00) | (w << 8 & 0xff0000) | (w << 24); }
+static U16 byteSwap(U16 h) { return U16((h >> 8) | (h << 8)); }
+
+// SCALE_BITS_TO_DEST_RANGE: repeat the top bits into the bottom ones
+static U16 scale10(U32 v) { return U16((v << 6) | (v >> 4)); }
+static U16 scale12(U32 v) { return U16((v << 4) | (v >> 8)); }
+
+// Component c of a packed row whose words are already in host order, as
+// decodeFromPacked10or12() reads it.
+static U32 packedComponent(const U32* words, int bits, int c)
+{
+  const int bit = c * bits;
+  const int a = bit / 32, b = bit % 32;
+  const U32 mask = (1u << bits) - 1;
+  if (b > 32 - bits)
+    return ((words[a + 1] << (32 - b)) + (words[a] >> b)) & mask;
+  return (words[a] >> b) & mask;
+}
+
+int main()
+{
+#ifdef DPX_WIDE_SIMD
+  static const DpxUnpackers ssse3 = { "ssse3", DpxFilled10SSSE3, DpxFilled10RevSSSE3, DpxFilled12SSSE3, DpxFilled12RgbaSSSE3, DpxPackedSSSE3 };
+  static const DpxUnpackers avx2 = { "avx2", DpxFilled10AVX2, DpxFilled10RevAVX2, DpxFilled12AVX2, DpxFilled12RgbaAVX2, DpxPackedAVX2 };
+  __builtin_cpu_init();
+  std::vector<const DpxUnpackers*> sets;
+  if (__builtin_cpu_supports("ssse3"))
+    sets.push_back(&ssse3);
+  if (__builtin_cpu_supports("avx2"))
+    sets.push_back(&avx2);
+#else
+  std::vector<const DpxUnpackers*> sets;
+#endif
+  printf("selected: %s\n", SelectDpxUnpackers().name);
+
+  std::mt19937 rng(3);
+  int failures = 0;
+  for (int iteration = 0; iteration < 3000; iteration++) {
+    const int words = rng() % 70;
+    const bool flip = rng() & 1, scale = rng() & 1, addAlpha = rng() & 1;
+    // packing 1 (method A) leaves the pad in the low bits, packing 2 in the high ones
+    const bool methodA = rng() & 1;
+    const int shifts[3] = { methodA ? 22 : 20, methodA ? 12 : 10, methodA ? 2 : 0 };
+    const int shift12 = methodA ? 4 : 0;
+    const U16 alpha = U16(rng());
+    std::vector<U32> src(words + 1);
+    for (U32& w : src)
+      w = rng();
+    const U16* src16 = reinterpret_cast<const U16*>(src.data());
+
+    for (const DpxUnpackers* unpack : sets) {
+      // filled 10 bit to U16 components, the rest of the output untouched
+      const int perWord = addAlpha ? 4 : 3;
+      std::vector<U16> expect10(4 * words + 8, 0xAAAA), got10(4 * words + 8, 0xAAAA);
+      U16* d = expect10.data();
+      for (int i = 0; i < words; i++) {
+        const U32 w = flip ? byteSwap(src[i]) : src[i];
+        for (int k = 0; k < 3; k++) {
+          const U32 v = (w >> shifts[k]) & 0x3ff;
+          *d++ = scale ? scale10(v) : U16(v);
+        }
+        if (addAlpha)
+          *d++ = alpha;
+      }
+      int done = unpack->filled10(src.data(), words, shifts, flip, scale, addAlpha, alpha, got10.data());
+      if (done > words || memcmp(expect10.data(), got10.data(), done * perWord * 2) || got10[done * perWord] != 0xAAAA) {
+        printf("%s filled10 differs: words %d done %d\n", unpack->name, words, done);
+        failures++;
+      }
+
+      // filled 10 bit to GL_UNSIGNED_INT_2_10_10_10_REV
+      std::vector<U32> expectRev(words + 4, 7), gotRev(words + 4, 7);
+      const U32 alphaRev = U32(rng() & 3) << 30;
+      for (int i = 0; i < words; i++) {
+        const U32 w = flip ? byteSwap(src[i]) : src[i];
+        expectRev[i] = ((w >> shifts[0]) & 0x3ff) | (((w >> shifts[1]) & 0x3ff) << 10) |
+                       (((w >> shifts[2]) & 0x3ff) << 20) | alphaRev;
+      }
+      done = unpack->filled10Rev(src.data(), words, shifts, flip, alphaRev, gotRev.data());
+      if (done > words || memcmp(expectRev.data(), gotRev.data(), done * 4) || gotRev[done] != 7) {
+        printf("%s filled10Rev differs: words %d done %d\n", unpack->name, words, done);
+        failures++;
+      }
+
+      // filled 12 bit components, out of place and in place
+      const int components = words * 2;
+      std::vector<U16> expect12(components + 4, 1), got12(components + 4, 1);
+      for (int i = 0; i < components; i++) {
+        const U16 h = flip ? byteSwap(src16[i]) : src16[i];
+        const U32 v = (h >> shift12) & 0xfff;
+        expect12[i] = scale ? scale12(v) : U16(v);
+      }
+      done = unpack->filled12(src16, components, shift12, flip, scale, got12.data());
+      if (done > components || memcmp(expect12.data(), got12.data(), done * 2) || got12[done] != 1) {
+        printf("%s filled12 differs: components %d done %d\n", unpack->name, components, done);
+        failures++;
+      }
+      std::vector<U16> inPlace(src16, src16 + components);
+      inPlace.resize(components + 4, 1);
+      done = unpack->filled12(inPlace.data(), components, shift12, flip, scale, inPlace.data());
+      if (done > components || memcmp(expect12.data(), inPlace.data(), done * 2)) {
+        printf("%s filled12 in place differs: components %d done %d\n", unpack->name, components, done);
+        failures++;
+      }
+
+      // filled 12 bit rgb to rgba
+      const int pixels = components / 3;
+      std::vector<U16> expectRgba(4 * pixels + 8, 1), gotRgba(4 * pixels + 8, 1);
+      for (int i = 0; i < pixels; i++) {
+        for (int k = 0; k < 3; k++) {
+          const U16 h = flip ? byteSwap(src16[3 * i + k]) : src16[3 * i + k];
+          const U32 v = (h >> shift12) & 0xfff;
+          expectRgba[4 * i + k] = scale ? scale12(v) : U16(v);
+        }
+        expectRgba[4 * i + 3] = alpha;
+      }
+      done = unpack->filled12Rgba(src16, pixels, shift12, flip, scale, alpha, gotRgba.data());
+      if (done > pixels || memcmp(expectRgba.data(), gotRgba.data(), done * 8) || gotRgba[done * 4] != 1) {
+        printf("%s filled12Rgba differs: pixels %d done %d\n", unpack->name, pixels, done);
+        failures++;
+      }
+    }
+  }
+
+  // packed 10 and 12 bit, with the row exactly as long as its bits so that
+  // a read past it would be caught by -fsanitize=address
+  for (int iteration = 0; iteration < 3000; iteration++) {
+    const int bits = rng() & 1 ? 10 : 12;
+    const bool flip = rng() & 1, scale = rng() & 1, addAlpha = rng() & 1;
+    const int components = addAlpha ? 3 * int(rng() % 120) : int(rng() % 360);
+    const int words = (components * bits + 31) / 32;
+    const U16 alpha = U16(rng());
+    std::vector<U32> src(words);
+    for (U32& w : src)
+      w = rng();
+    std::vector<U32> host(src);
+    host.push_back(0);
+    if (flip) {
+      for (U32& w : host)
+        w = byteSwap(w);
+    }
+
+    const int outPer3 = addAlpha ? 4 : 3;
+    std::vector<U16> expect(components / 3 * outPer3 + components % 3 + 8, 0xAAAA);
+    U16* d = expect.data();
+    for (int c = 0; c < components; c++) {
+      const U32 v = packedComponent(host.data(), bits, c);
+      *d++ = scale ? (bits == 10 ? scale10(v) : scale12(v)) : U16(v);
+      if (addAlpha && c % 3 == 2)
+        *d++ = alpha;
+    }
+
+    for (const DpxUnpackers* unpack : sets) {
+      std::vector<U16> got(expect.size(), 0xAAAA);
+      const int done = unpack->packed(src.data(), words, bits, flip, scale, addAlpha, alpha, components, got.data());
+      const int written = done / 3 * outPer3 + (addAlpha ? 0 : done % 3);
+      if (done > components || (addAlpha && done % 3) || memcmp(expect.data(), got.data(), written * 2) || got[written] != 0xAAAA) {
+        printf("%s packed%d differs: components %d done %d\n", unpack->name, bits, components, done);
+        failures++;
+      }
+    }
+  }
+  printf("%d failures\n", failures);
+
+  // one 4096 x 2160 frame of byte swapped, scaled 10 bit rgb
+  const int words = 4096 * 2160;
+  std::vector<U32> frame(words, 0x12345678);
+  std::vector<U16> out(3 * words + 16);
+  const int shifts[3] = { 22, 12, 2 };
+  const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  U16* d = out.data();
+  for (int i = 0; i < words; i++) {
+    const U32 w = byteSwap(frame[i]);
+    for (int k = 0; k < 3; k++)
+      *d++ = scale10((w >> shifts[k]) & 0x3ff);
+  }
+  const std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  SelectDpxUnpackers().filled10(frame.data(), words, shifts, true, true, false, 0, out.data());
+  const std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+  printf("filled10 frame: scalar %.1f ms, %s %.1f ms (%d)\n",
+         std::chrono::duration<double, std::milli>(t1 - t0).count(), SelectDpxUnpackers().name,
+         std::chrono::duration<double, std::milli>(t2 - t1).count(), out[5]);
+
+  // the same frame as packed 10 bit rgb, which fits in fewer words
+  const int components = 3 * 4096 * 2160;
+  const int packedWords = components * 10 / 32;
+  const std::chrono::steady_clock::time_point t3 = std::chrono::steady_clock::now();
+  std::vector<U32> host(packedWords + 1);
+  for (int i = 0; i < packedWords; i++)
+    host[i] = byteSwap(frame[i]);
+  for (int c = 0; c < components; c++)
+    out[c] = scale10(packedComponent(host.data(), 10, c));
+  const std::chrono::steady_clock::time_point t4 = std::chrono::steady_clock::now();
+  SelectDpxUnpackers().packed(frame.data(), packedWords, 10, true, true, false, 0, components, out.data());
+  const std::chrono::steady_clock::time_point t5 = std::chrono::steady_clock::now();
+  printf("packed10 frame: scalar %.1f ms, %s %.1f ms (%d)\n",
+         std::chrono::duration<double, std::milli>(t4 - t3).count(), SelectDpxUnpackers().name,
+         std::chrono::duration<double, std::milli>(t5 - t4).count(), out[5]);
+
+  return failures ? 1 : 0;
+}
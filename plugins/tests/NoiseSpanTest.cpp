@@ -0,0 +1,144 @@
+// Copyright (c) 2009 The Foundry Visionmongers Ltd.  All Rights Reserved.
+
+// NoiseSpanTest.cpp
+
+// Standalone check and benchmark of the span evaluators in NoiseSpan.h. It is
+// not built by compile.sh. Build and run it with:
+//
+//   g++ -O2 -std=c++17 -o NoiseSpanTest plugins/tests/NoiseSpanTest.cpp && ./NoiseSpanTest
+//
+// By default the spans are compared with a double evaluation of Ken Perlin's
+// reference improved noise below. Add -DNOISE_SPAN_TEST_DDIMAGE and the NDK
+// include and library paths to compare with DDImage's fBm() and turbulence()
+// instead, which is what Noise calls with its vectorise knob off.
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../NoiseSpan.h"
+
+#ifdef NOISE_SPAN_TEST_DDIMAGE
+  #include "DDImage/noise.h"
+#endif
+
+#ifdef NOISE_SPAN_TEST_DDIMAGE
+
+static double referenceNoise(double x, double y, double z, int octaves, double lacunarity, double gain, bool turbulence)
+{
+  return turbulence ? DD::Image::turbulence(x, y, z, octaves, lacunarity, gain)
+                    : DD::Image::fBm(x, y, z, octaves, lacunarity, gain);
+}
+
+#else
+
+static double fade(double t) { return t * t * t * (t * (t * 6 - 15) + 10); }
+static double lerp(double t, double a, double b) { return a + t * (b - a); }
+
+static double grad(int hash, double x, double y, double z)
+{
+  const int h = hash & 15;
+  const double u = h < 8 ? x : y;
+  const double v = h < 4 ? y : h == 12 || h == 14 ? x : z;
+  return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+}
+
+static double noise(double x, double y, double z)
+{
+  const int* P = kNoisePerm.p;
+  const int X = int(floor(x)) & 255, Y = int(floor(y)) & 255, Z = int(floor(z)) & 255;
+  x -= floor(x);
+  y -= floor(y);
+  z -= floor(z);
+  const double u = fade(x), v = fade(y), w = fade(z);
+  const int A = P[X] + Y, AA = P[A] + Z, AB = P[A + 1] + Z;
+  const int B = P[X + 1] + Y, BA = P[B] + Z, BB = P[B + 1] + Z;
+  return lerp(w, lerp(v, lerp(u, grad(P[AA], x, y, z), grad(P[BA], x - 1, y, z)),
+                         lerp(u, grad(P[AB], x, y - 1, z), grad(P[BB], x - 1, y - 1, z))),
+                 lerp(v, lerp(u, grad(P[AA + 1], x, y, z - 1), grad(P[BA + 1], x - 1, y, z - 1)),
+                         lerp(u, grad(P[AB + 1], x, y - 1, z - 1), grad(P[BB + 1], x - 1, y - 1, z - 1))));
+}
+
+static double referenceNoise(double x, double y, double z, int octaves, double lacunarity, double gain, bool turbulence)
+{
+  double sum = 0, amp = 1;
+  for (int i = 0; i < octaves; i++) {
+    const double n = noise(x, y, z);
+    sum += amp * (turbulence ? fabs(n) : n);
+    amp *= gain;
+    x *= lacunarity;
+    y *= lacunarity;
+    z *= lacunarity;
+  }
+  return sum;
+}
+
+#endif
+
+static double milliseconds(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b)
+{
+  return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+int main()
+{
+  const NoiseSpanFn selected = SelectNoiseSpan();
+  printf("selected: %s\n", selected == NoiseSpanScalar ? "scalar" : "avx2");
+
+  // largest difference from the reference over random spans
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> position(-50, 50), step(-0.01, 0.01);
+  const int n = 2000;
+  std::vector<float> scalar(n), simd(n);
+  double scalarError = 0, simdError = 0;
+  for (int t = 0; t < 200; t++) {
+    const double start[3] = { position(rng), position(rng), position(rng) };
+    const double delta[3] = { step(rng), step(rng), step(rng) * 0.1 };
+    const bool turbulence = t & 1;
+    const int octaves = 1 + t % 10;
+    const double lacunarity = t % 3 ? 2.0 : 2.7;
+    const int count = n - t;
+    NoiseSpanScalar(start, delta, count, octaves, lacunarity, 0.5, turbulence, scalar.data());
+    selected(start, delta, count, octaves, lacunarity, 0.5, turbulence, simd.data());
+    for (int i = 0; i < count; i++) {
+      const double r = referenceNoise(start[0] + delta[0] * i, start[1] + delta[1] * i, start[2] + delta[2] * i,
+                                      octaves, lacunarity, 0.5, turbulence);
+      scalarError = std::max(scalarError, fabs(r - scalar[i]));
+      simdError = std::max(simdError, fabs(r - simd[i]));
+    }
+  }
+  printf("max error: scalar %g, selected %g, tolerance %g\n", scalarError, simdError, kNoiseSpanTolerance);
+
+  // 500 rows of 2048 pixels, 10 octaves of fBm
+  const double start[3] = { 0.1, 0.2, 0.3 };
+  const double delta[3] = { 1 / 350.0, 0.001, 0 };
+  std::vector<float> row(2048);
+  double checksum = 0;
+
+  const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (int k = 0; k < 500; k++) {
+    for (int i = 0; i < 2048; i++)
+      row[i] = float(referenceNoise(start[0] + delta[0] * i, start[1] + delta[1] * i, start[2] + k, 10, 2, 0.5, false));
+    checksum += row[7];
+  }
+  const std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  for (int k = 0; k < 500; k++) {
+    const double rowStart[3] = { start[0], start[1], start[2] + k };
+    NoiseSpanScalar(rowStart, delta, 2048, 10, 2, 0.5, false, row.data());
+    checksum += row[7];
+  }
+  const std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+  for (int k = 0; k < 500; k++) {
+    const double rowStart[3] = { start[0], start[1], start[2] + k };
+    selected(rowStart, delta, 2048, 10, 2, 0.5, false, row.data());
+    checksum += row[7];
+  }
+  const std::chrono::steady_clock::time_point t3 = std::chrono::steady_clock::now();
+
+  printf("per pixel reference %.1f ms, scalar span %.1f ms, selected span %.1f ms (%g)\n",
+         milliseconds(t0, t1), milliseconds(t1, t2), milliseconds(t2, t3), checksum);
+
+  // Noise only uses the spans within this of DDImage
+  return scalarError < kNoiseSpanTolerance && simdError < kNoiseSpanTolerance ? 0 : 1;
+}